@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+/*
+ * Trace replay benchmark.
+ *
+ *     bin/sfmm_bench [-g] [-l] [-o NAME=value]... trace...
+ *     bin/sfmm_bench -c trace.rep trace.bin
+ *
+ * Each trace is replayed against sf_malloc/sf_free/sf_realloc, and with -g against the
+ * C library's allocator too, each in a child process of its own so that every replay
+ * starts from an empty heap.  -o passes an SF_OPT_* parameter, named without its
+ * prefix (-o TREE_THRESHOLD=64, say), to sf_mallopt() before the replay.  -c converts a
+ * text trace to the binary format.  -l prints sf_latency_dump() after each sf_* replay,
+ * for a build with -DPROFILE_LATENCY in BENCH_CFLAGS.
+ *
+ * Text traces are in the malloclab format: four header numbers (suggested heap size,
+ * number of ids, number of operations, weight), then one operation per line:
+ *
+ *     a <id> <size>    allocate
+ *     r <id> <size>    reallocate
+ *     f <id>           free
+ *
+ * Binary traces are a bench_header followed by one 8-byte bench_record per operation.
+ * The heap is the mmap-backed one from preload/sfmm_mem.c, since sfutil.o's 37 pages
+ * are too few for recorded workloads.
+ */
+
+#define BENCH_MAGIC "SFTR"
+
+typedef struct {
+    char magic[4];
+    uint32_t ids;
+    uint32_t ops;
+    uint32_t reserved;
+} bench_header;
+
+/* The operation is in the top two bits of op_id, the id in the rest. */
+typedef struct {
+    uint32_t op_id;
+    uint32_t size;
+} bench_record;
+
+#define OP_ALLOC   0u
+#define OP_FREE    1u
+#define OP_REALLOC 2u
+#define OP_SHIFT   30
+#define ID_MASK    ((1u << OP_SHIFT) - 1)
+
+typedef struct {
+    uint32_t ids;
+    uint32_t ops;
+    bench_record *records;
+} bench_trace;
+
+typedef struct {
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*realloc)(void *, size_t);
+} bench_allocator;
+
+static const bench_allocator sf_allocator = {"sfmm", sf_malloc, sf_free, sf_realloc};
+static const bench_allocator libc_allocator = {"libc", malloc, free, realloc};
+
+static bool latency = false;
+
+static const struct {
+    const char *name;
+    int param;
+} bench_options[] = {
+    {"TCACHE_COUNT", SF_OPT_TCACHE_COUNT},
+    {"ARENA_COUNT", SF_OPT_ARENA_COUNT},
+    {"ARENA_POLICY", SF_OPT_ARENA_POLICY},
+    {"TREE_THRESHOLD", SF_OPT_TREE_THRESHOLD},
+    {"GROW_CHUNK", SF_OPT_GROW_CHUNK},
+    {"MMAP_THRESHOLD", SF_OPT_MMAP_THRESHOLD},
+    {"TRIM_THRESHOLD", SF_OPT_TRIM_THRESHOLD},
+    {"SLAB", SF_OPT_SLAB},
+    {"DEFER_COALESCE", SF_OPT_DEFER_COALESCE},
+    {"QUICK_LIST_MAX", SF_OPT_QUICK_LIST_MAX},
+};
+
+#define MAX_OPTIONS 16
+
+/**
+ * Parses a -o argument of the form NAME=value.
+ *
+ * @return false if the name is not that of an option.
+ */
+static bool parse_option(const char *arg, int *param, int *value) {
+    const char *equals = strchr(arg, '=');
+    if (equals == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(bench_options) / sizeof(bench_options[0]); i++) {
+        if (strlen(bench_options[i].name) == (size_t)(equals - arg) &&
+            strncmp(bench_options[i].name, arg, equals - arg) == 0) {
+            *param = bench_options[i].param;
+            *value = atoi(equals + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int load_text(FILE *file, bench_trace *trace) {
+    unsigned long heap_size, ids, ops, weight;
+    if (fscanf(file, "%lu %lu %lu %lu", &heap_size, &ids, &ops, &weight) != 4 || ids > ID_MASK) {
+        return -1;
+    }
+
+    trace->ids = ids;
+    trace->ops = 0;
+    trace->records = malloc(ops * sizeof(bench_record));
+    if (trace->records == NULL) {
+        return -1;
+    }
+
+    char op;
+    unsigned long id, size;
+    while (trace->ops < ops && fscanf(file, " %c %lu", &op, &id) == 2) {
+        size = 0;
+        if ((op == 'a' || op == 'r') && fscanf(file, "%lu", &size) != 1) {
+            return -1;
+        }
+        if (id >= ids || size > UINT32_MAX || (op != 'a' && op != 'r' && op != 'f')) {
+            return -1;
+        }
+        uint32_t code = op == 'a' ? OP_ALLOC : op == 'f' ? OP_FREE : OP_REALLOC;
+        trace->records[trace->ops].op_id = code << OP_SHIFT | id;
+        trace->records[trace->ops].size = size;
+        trace->ops++;
+    }
+    return trace->ops == ops ? 0 : -1;
+}
+
+static int load_binary(FILE *file, bench_trace *trace) {
+    bench_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.ids > ID_MASK) {
+        return -1;
+    }
+
+    trace->ids = header.ids;
+    trace->ops = header.ops;
+    trace->records = malloc((size_t)header.ops * sizeof(bench_record));
+    if (trace->records == NULL || fread(trace->records, sizeof(bench_record), header.ops, file) != header.ops) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < trace->ops; i++) {
+        if ((trace->records[i].op_id & ID_MASK) >= trace->ids) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads a trace in either format, telling them apart by the binary magic.
+ */
+static int load_trace(const char *path, bench_trace *trace) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char magic[4];
+    bool binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BENCH_MAGIC, 4) == 0;
+    rewind(file);
+
+    trace->records = NULL;
+    int result = binary ? load_binary(file, trace) : load_text(file, trace);
+    fclose(file);
+    if (result != 0) {
+        free(trace->records);
+    }
+    return result;
+}
+
+static int save_binary(const char *path, bench_trace *trace) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    bench_header header = {BENCH_MAGIC, trace->ids, trace->ops, 0};
+    int result = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(trace->records, sizeof(bench_record), trace->ops, file) == trace->ops ? 0 : -1;
+    return fclose(file) == 0 ? result : -1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Replays a trace and prints one line of results.  Fragmentation is taken when the
+ * requested bytes live peak, the same moment sf_utilization() reports on, since a
+ * trace that frees everything ends with nothing to measure.
+ *
+ * @return false if an allocation failed.
+ */
+static bool replay(const char *path, bench_trace *trace, const bench_allocator *allocator) {
+    void **ptrs = calloc(trace->ids, sizeof(void *));
+    uint32_t *sizes = calloc(trace->ids, sizeof(uint32_t));
+    if (ptrs == NULL || sizes == NULL) {
+        return false;
+    }
+
+    bool measure = allocator == &sf_allocator;
+    size_t live = 0, peak_live = 0;
+    double peak_fragmentation = 0.0;
+
+    double start = now();
+    for (uint32_t i = 0; i < trace->ops; i++) {
+        bench_record *record = &trace->records[i];
+        uint32_t id = record->op_id & ID_MASK;
+        switch (record->op_id >> OP_SHIFT) {
+            case OP_ALLOC:
+                ptrs[id] = allocator->malloc(record->size);
+                break;
+            case OP_FREE:
+                allocator->free(ptrs[id]);
+                ptrs[id] = NULL;
+                live -= sizes[id];
+                sizes[id] = 0;
+                continue;
+            default:
+                ptrs[id] = allocator->realloc(ptrs[id], record->size);
+                break;
+        }
+        if (ptrs[id] == NULL && record->size != 0) {
+            fprintf(stderr, "%s: %s ran out of memory at operation %u\n", path, allocator->name, i);
+            return false;
+        }
+
+        live += record->size - sizes[id];
+        sizes[id] = record->size;
+        if (measure && live > peak_live) {
+            peak_live = live;
+            peak_fragmentation = sf_fragmentation();
+        }
+    }
+    double seconds = now() - start;
+
+    printf("%-24s %-5s %10u %10.4f %12.0f", path, allocator->name, trace->ops, seconds,
+           seconds > 0 ? trace->ops / seconds : 0.0);
+    if (measure) {
+        printf(" %7.3f %7.3f %10zu", sf_utilization(), peak_fragmentation,
+               (size_t)((char *)sf_mem_end() - (char *)sf_mem_start()));
+    }
+    printf("\n");
+    if (allocator == &sf_allocator && latency) {
+        sf_latency_dump(stdout);
+    }
+    return true;
+}
+
+/**
+ * Runs a replay in a child process, so that it starts from an empty heap.
+ */
+static bool replay_child(const char *path, bench_trace *trace, const bench_allocator *allocator,
+                         int *options, int option_count) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        for (int i = 0; i < option_count; i++) {
+            if (!sf_mallopt(options[2 * i], options[2 * i + 1])) {
+                fprintf(stderr, "sf_mallopt(%d, %d) failed\n", options[2 * i], options[2 * i + 1]);
+                _exit(1);
+            }
+        }
+        bool ok = replay(path, trace, allocator);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-g] [-l] [-o NAME=value]... trace...\n"
+                    "       %s -c trace.rep trace.bin\n", name, name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    bool baseline = false;
+    const char *convert = NULL;
+    int options[2 * MAX_OPTIONS];
+    int option_count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "glc:o:")) != -1) {
+        switch (opt) {
+            case 'g':
+                baseline = true;
+                break;
+            case 'l':
+                latency = true;
+                break;
+            case 'c':
+                convert = optarg;
+                break;
+            case 'o':
+                if (option_count == MAX_OPTIONS ||
+                    !parse_option(optarg, &options[2 * option_count], &options[2 * option_count + 1])) {
+                    usage(argv[0]);
+                }
+                option_count++;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (convert != NULL) {
+        bench_trace trace;
+        if (optind != argc - 1 || load_trace(convert, &trace) != 0) {
+            fprintf(stderr, "%s: cannot read trace\n", convert);
+            return 1;
+        }
+        if (save_binary(argv[optind], &trace) != 0) {
+            fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+
+    printf("%-24s %-5s %10s %10s %12s %7s %7s %10s\n", "trace", "alloc", "ops", "seconds", "ops/sec",
+           "util", "frag", "heap");
+
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        bench_trace trace;
+        if (load_trace(argv[i], &trace) != 0) {
+            fprintf(stderr, "%s: cannot read trace\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        failures += !replay_child(argv[i], &trace, &sf_allocator, options, option_count);
+        if (baseline) {
+            failures += !replay_child(argv[i], &trace, &libc_allocator, NULL, 0);
+        }
+        free(trace.records);
+    }
+    return failures != 0;
+}
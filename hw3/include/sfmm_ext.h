@@ -0,0 +1,279 @@
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+
+/*
+ * Extensions to the allocator interface.  sfmm.h is fixed by the assignment,
+ * so any additional prototypes and constants live here.
+ */
+
+#include <stdio.h>
+#include "sfmm.h"
+
+/*
+ * Tunable parameters accepted by sf_mallopt().
+ *
+ * SF_OPT_TCACHE_COUNT  Maximum number of blocks held by each per-thread cache bin.
+ *                      Zero disables the per-thread caches.  Default 16.
+ * SF_OPT_ARENA_COUNT   Number of independent arenas, from 1 to 64.  Can only be set
+ *                      before the first allocation.  Default 1.
+ * SF_OPT_ARENA_POLICY  How threads are assigned to arenas on their first allocation:
+ *                      SF_ARENA_ROUND_ROBIN (default) or SF_ARENA_LEAST_LOADED, which
+ *                      picks the arena with the fewest live threads.
+ * SF_OPT_TREE_THRESHOLD
+ *                      Free blocks larger than this many bytes are indexed in a
+ *                      size-keyed tree and allocated best-fit.  Can only be set before
+ *                      the first allocation.  Default 32768 (the last free list).
+ * SF_OPT_GROW_CHUNK    Fewest bytes the heap is grown by when no free block fits,
+ *                      rounded up to whole pages.  Default one page.
+ * SF_OPT_MMAP_THRESHOLD
+ *                      Requests larger than this many bytes get an anonymous mapping of
+ *                      their own, unmapped as soon as they are freed.  Zero (the default)
+ *                      keeps every request in the heap.
+ * SF_OPT_TRIM_THRESHOLD
+ *                      Once a free block at the end of the heap grows larger than this
+ *                      many bytes, its pages are returned to the system.  Zero (the
+ *                      default) leaves trimming to sf_trim().
+ * SF_OPT_SLAB          Non-zero serves requests of up to 192 bytes from page-sized
+ *                      slab runs, with no per-object header or footer.  The runs get
+ *                      per-thread bins of their own, holding SF_OPT_TCACHE_COUNT
+ *                      objects each.  Default 0.
+ * SF_OPT_DEFER_COALESCE
+ *                      Non-zero leaves freed blocks uncoalesced on an unsorted bin until
+ *                      a request misses the free lists or the bin holds more than this
+ *                      many bytes.  Zero (the default) coalesces on every free.
+ * SF_OPT_QUICK_LIST_MAX
+ *                      Most blocks a quick list may hold.  At QUICK_LIST_MAX (the default)
+ *                      every list holds that many and is flushed whole, as sfmm.h has it.
+ *                      Above it, each list grows when blocks it flushed are asked for
+ *                      again, shrinks when none of its blocks are reused between flushes,
+ *                      and a full list flushes only its oldest half.
+ */
+#define SF_OPT_TCACHE_COUNT   1
+#define SF_OPT_ARENA_COUNT    2
+#define SF_OPT_ARENA_POLICY   3
+#define SF_OPT_TREE_THRESHOLD 4
+#define SF_OPT_GROW_CHUNK     5
+#define SF_OPT_MMAP_THRESHOLD 6
+#define SF_OPT_TRIM_THRESHOLD 7
+#define SF_OPT_SLAB           8
+#define SF_OPT_DEFER_COALESCE 9
+#define SF_OPT_QUICK_LIST_MAX 10
+
+#define SF_ARENA_ROUND_ROBIN  0
+#define SF_ARENA_LEAST_LOADED 1
+
+/*
+ * Adjusts one of the allocator's tunable parameters.
+ *
+ * @param param  One of the SF_OPT_* constants above.
+ * @param value  The new value for the parameter.
+ *
+ * @return 1 if the parameter was changed, 0 if param is unknown or value is out of range.
+ */
+int sf_mallopt(int param, int value);
+
+/*
+ * Returns the pages of free blocks to the system.  The heap keeps its size, since
+ * sf_mem_grow() cannot be undone, but the released pages are no longer resident until
+ * they are allocated again.  sf_utilization() is relative to the peak resident heap, so
+ * trimming does not change it.
+ *
+ * @param pad  Bytes to keep untouched at the start of each free block at the end of
+ *             the heap, for allocations expected soon.
+ *
+ * @return 1 if any memory was released, 0 otherwise.
+ */
+int sf_trim(size_t pad);
+
+/*
+ * Allocates n blocks of size bytes each in one go, cutting as many as possible from
+ * each free block found.
+ *
+ * @param out  Receives the n payload pointers, which are freed individually as usual.
+ *
+ * @return The number of blocks allocated.  If fewer than n, sf_errno is set to ENOMEM.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void **out);
+
+/*
+ * Frees n blocks in one go.  Blocks that are next to each other in the heap are merged
+ * and coalesced once.  NULL entries are ignored.
+ *
+ * @param ptrs  The payload pointers to free, which are sorted by address in place.
+ */
+void sf_free_batch(void **ptrs, size_t n);
+
+/*
+ * Allocates zero-filled space for n objects of size bytes each.  Memory that has never
+ * been handed out is known to be zero already and is not cleared again.
+ *
+ * @return The payload pointer, or NULL if n or size is zero.  If n * size overflows or
+ * the memory cannot be found, sf_errno is set to ENOMEM and NULL is returned.
+ */
+void *sf_calloc(size_t n, size_t size);
+
+/*
+ * Allocates size bytes whose payload address is a multiple of align.  The block is
+ * freed and resized with sf_free() and sf_realloc() as usual, though a moved block is
+ * only 16-byte aligned.
+ *
+ * @param align  A power of two.  Alignments of 16 or less are those of sf_malloc().
+ *
+ * @return The payload pointer, or NULL if size is zero.  If align is not a power of two,
+ * sf_errno is set to EINVAL and NULL is returned; if the memory cannot be found,
+ * sf_errno is set to ENOMEM.
+ */
+void *sf_aligned_alloc(size_t align, size_t size);
+
+/*
+ * sf_aligned_alloc() with the posix_memalign() interface: align must also be a multiple
+ * of sizeof(void *), and the payload pointer is stored in *memptr.
+ *
+ * @return 0 on success, EINVAL for a bad alignment or ENOMEM if the memory cannot be found.
+ */
+int sf_posix_memalign(void **memptr, size_t align, size_t size);
+
+/*
+ * sf_free() for a caller that knows the block's size, which must lie between the size
+ * requested and sf_malloc_usable_size().  A size outside that range, or a pointer that
+ * is not an allocated block, aborts the program, unless the allocator was built with
+ * -DTRUST_SIZED_FREE, which skips the check.
+ */
+void sf_free_sized(void *ptr, size_t size);
+
+/*
+ * @return The number of bytes the block at ptr can hold, which may be more than were
+ * requested.  All of them may be used, and are kept by sf_realloc().  0 for NULL.
+ */
+size_t sf_malloc_usable_size(void *ptr);
+
+/*
+ * Paths through sf_malloc(), sf_free() and sf_realloc(), for the latency histograms.
+ *
+ * SF_PATH_MALLOC_FIT    A free block used whole, with nothing left to split off.
+ * SF_PATH_MALLOC_SPLIT  A free block split, the rest going back on the free lists.
+ * SF_PATH_MALLOC_GROW   No free block fitted, so the heap was grown first.
+ * SF_PATH_FREE_FLUSH    A full quick list was flushed before caching the block.
+ * SF_PATH_FREE_REMOTE   Another arena's block, queued for its owner.
+ * SF_PATH_FREE_ALONE .. SF_PATH_FREE_BOTH
+ *                       The block coalesced with neither neighbour, the previous, the
+ *                       next or both.
+ * SF_PATH_REALLOC_EXTEND
+ *                       The block grew into its neighbours without being copied.
+ *
+ * The others are served by the cache, list or mapping they name.
+ */
+#define SF_PATH_MALLOC_TCACHE   0
+#define SF_PATH_MALLOC_SLAB     1
+#define SF_PATH_MALLOC_QUICK    2
+#define SF_PATH_MALLOC_FIT      3
+#define SF_PATH_MALLOC_SPLIT    4
+#define SF_PATH_MALLOC_GROW     5
+#define SF_PATH_MALLOC_MMAP     6
+#define SF_PATH_FREE_TCACHE     7
+#define SF_PATH_FREE_SLAB       8
+#define SF_PATH_FREE_QUICK      9
+#define SF_PATH_FREE_FLUSH      10
+#define SF_PATH_FREE_REMOTE     11
+#define SF_PATH_FREE_DEFER      12
+#define SF_PATH_FREE_ALONE      13
+#define SF_PATH_FREE_PREV       14
+#define SF_PATH_FREE_NEXT       15
+#define SF_PATH_FREE_BOTH       16
+#define SF_PATH_FREE_MMAP       17
+#define SF_PATH_REALLOC_SHRINK  18
+#define SF_PATH_REALLOC_EXTEND  19
+#define SF_PATH_REALLOC_MOVE    20
+#define SF_PATH_REALLOC_MMAP    21
+#define SF_PATH_COUNT           22
+
+/*
+ * Latency histograms, one per SF_PATH_* constant, filled in only by a build with
+ * -DPROFILE_LATENCY; otherwise they stay empty.  Times are TSC cycles on x86 and
+ * nanoseconds elsewhere.
+ *
+ * @return sf_latency_count(): the number of calls that took the path.
+ * sf_latency_percentile(): an upper bound, within a quarter, on the time that the given
+ * fraction of those calls (0.99, say) took at most, or 0 if there were none.
+ */
+uint64_t sf_latency_count(int path);
+uint64_t sf_latency_percentile(int path, double fraction);
+
+/*
+ * Prints the count, p50, p99 and p999 of every path taken so far to out.
+ */
+void sf_latency_dump(FILE *out);
+
+/*
+ * Empties the latency histograms, to measure from a known point.
+ */
+void sf_latency_reset(void);
+
+/*
+ * Allocator statistics, kept as counters as the allocator goes, summed over all arenas.
+ * Classes are those of sf_free_list_heads, indexes those of sf_quick_lists.
+ *
+ * quick_hits           Requests served from a quick list, or blocks moved from one to a
+ *                      per-thread cache.
+ * quick_misses         Requests of a quick list's size that found it empty.
+ * quick_flushes        Times a full quick list was emptied into the free lists.
+ * free_list_hits       Requests served from the free lists, by the class of the block found.
+ * splits               Blocks split, the rest going back on the free lists.
+ * splinters_avoided    Blocks left whole because the rest would have been too small.
+ * coalesce_*           Blocks freed into the free lists, by which neighbours they merged with.
+ * mem_grows            sf_mem_grow() calls.
+ * live_blocks, live_bytes
+ *                      Allocated heap blocks and their total size.  Blocks on a per-thread
+ *                      cache count as live; those on a quick list do not.  Slab objects and
+ *                      mapped blocks are not counted.
+ * free_blocks, free_bytes
+ *                      Blocks on the free lists and their total size, a histogram of free
+ *                      space by class.  Quick lists and caches hold allocated blocks.
+ * largest_free         The largest block on the free lists, in any arena.
+ */
+typedef struct {
+    uint64_t quick_hits[NUM_QUICK_LISTS];
+    uint64_t quick_misses[NUM_QUICK_LISTS];
+    uint64_t quick_flushes[NUM_QUICK_LISTS];
+    uint64_t free_list_hits[NUM_FREE_LISTS];
+    uint64_t splits;
+    uint64_t splinters_avoided;
+    uint64_t coalesce_none;
+    uint64_t coalesce_prev;
+    uint64_t coalesce_next;
+    uint64_t coalesce_both;
+    uint64_t mem_grows;
+    uint64_t live_blocks[NUM_FREE_LISTS];
+    uint64_t live_bytes[NUM_FREE_LISTS];
+    uint64_t free_blocks[NUM_FREE_LISTS];
+    uint64_t free_bytes[NUM_FREE_LISTS];
+    uint64_t largest_free;
+} sf_stats;
+
+/*
+ * Copies the current statistics into *stats.  Takes no lock and does not walk the heap,
+ * so it can be called often without holding up allocations, but a snapshot taken while
+ * other threads allocate may be a few operations out of step between counters.
+ */
+void sf_get_stats(sf_stats *stats);
+
+/*
+ * sf_fragmentation() the slow way, by walking every block in the heap, which is what it
+ * used to do.  For checking the running totals sf_fragmentation() now keeps while
+ * debugging.  They agree when the per-thread caches are off (SF_OPT_TCACHE_COUNT 0) or
+ * when no thread but the caller is alive.  Otherwise, other threads' caches add the
+ * payload they hand out and take back to the totals only on a refill or drain, so the
+ * totals can lag the walk until then.
+ */
+double sf_fragmentation_walk(void);
+
+/*
+ * External fragmentation: the share of free bytes outside the largest free block, from
+ * 0 when the free space is all in one block towards 1 as it is scattered in pieces too
+ * small for anything big.  Like sf_get_stats(), takes no lock and walks nothing.
+ *
+ * @return 1 - largest_free / the total of free_bytes, or 0 if nothing is free.
+ */
+double sf_external_fragmentation(void);
+
+#endif
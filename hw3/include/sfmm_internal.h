@@ -0,0 +1,438 @@
+#ifndef SFMM_INTERNAL_H
+#define SFMM_INTERNAL_H
+
+/*
+ * Definitions shared between the allocator's source files.
+ * None of this is part of the client interface (see sfmm.h and sfmm_ext.h).
+ */
+
+#include <pthread.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define ENOMEM 12
+#define EINVAL 22
+
+/*
+ * Built with -DCOMPACT_LINKS, free-list links are 32-bit offsets from sf_mem_start()
+ * rather than pointers, and allocated blocks lose their footers (see ELIDE_FOOTERS
+ * below).  A free block then fits in 16 bytes: its header and two links, with no room
+ * for a footer, which prev_free_size() accounts for.  sfutil.o's printers read the
+ * links as pointers, so src/sfmm_show.c stands in for the ones that follow them.
+ */
+#ifdef COMPACT_LINKS
+#ifndef ELIDE_FOOTERS
+#define ELIDE_FOOTERS
+#endif
+#define MIN_BLOCK_SIZE 16
+#else
+#define MIN_BLOCK_SIZE 32
+#endif
+
+/* Largest block size that is cached on a quick list. */
+#define QUICK_LIST_LIMIT (MIN_BLOCK_SIZE + (NUM_QUICK_LISTS - 1) * 16)
+/* Quick list index of a block of the given (aligned) size. */
+#define QUICK_LIST_INDEX(size) ((int)(((size) - MIN_BLOCK_SIZE) / 16))
+
+/* Header bit marking a block that has a mapping of its own (see sfmm_mmap.c). */
+#define MMAPPED 0x4
+/*
+ * Header bit set while the block physically before this one is allocated (or is the
+ * prologue).  Coalescing only reads the previous block's footer when it is clear.
+ */
+#define PREV_BLOCK_ALLOCATED 0x8
+/* Free block header bit, in the unused payload field, marking released pages (see sfmm_trim.c). */
+#define PAGES_RELEASED ((uint64_t)1 << 32)
+/*
+ * Free block header bit set while the block holds nothing but zeros apart from its first
+ * ZERO_KEEP bytes (header, list and tree links, trimmed byte count) and its footer.  Pages
+ * grown once sf_calloc() is in use start out that way (see trim_zero()), and sf_calloc()
+ * only clears those words of a block cut from one.
+ */
+#define KNOWN_ZERO ((uint64_t)1 << 33)
+#define ZERO_KEEP (sizeof(sf_header) + 4 * sizeof(sf_block *) + sizeof(size_t))
+
+/*
+ * Only free blocks need a footer, and PREV_BLOCK_ALLOCATED says when that is, so an
+ * allocated block's footer is never written.  The default build still leaves room for
+ * one, since the block sizes the assignment expects count it; built with -DELIDE_FOOTERS,
+ * allocated blocks have no footer at all, and each allocation saves 8 bytes.
+ */
+#ifdef ELIDE_FOOTERS
+#define ALLOCATED_FOOTER_SIZE 0
+#else
+#define ALLOCATED_FOOTER_SIZE sizeof(sf_footer)
+#endif
+
+/* The bytes an allocated heap block of the given size can hold. */
+#define USABLE_SIZE(size) ((size) - sizeof(sf_header) - ALLOCATED_FOOTER_SIZE)
+
+/* Largest request served from a slab run, and the slab class of an object size. */
+#define SLAB_MAX_SIZE (QUICK_LIST_LIMIT - sizeof(sf_header) - sizeof(sf_footer))
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / 16)
+#define SLAB_INDEX(size) ((int)((size) / 16) - 1)
+
+/* Each free list is split into this many sub-lists (at most 32, one bitmap word). */
+#define NUM_SUB_LISTS 8
+
+/* Sizes up to the top of the last bounded free list each have a count of free blocks. */
+#define SIZE_COUNT_LIMIT ((size_t)MIN_BLOCK_SIZE << (NUM_FREE_LISTS - 2))
+#define NUM_SIZE_COUNTS (SIZE_COUNT_LIMIT / 16)
+
+/* Upper bounds on the number of arenas and heap segments. */
+#define SF_MAX_ARENAS   64
+#define SF_MAX_SEGMENTS 4096
+
+/* The element type of sf_quick_lists, which sfmm.h declares anonymously. */
+typedef __typeof__(sf_quick_lists[0]) sf_quick_list;
+
+/* How many blocks one of an arena's quick lists holds, see quick_list_make_room(). */
+typedef struct {
+    int capacity;                       // Blocks the list holds before it is flushed.
+    int flushed;                        // Blocks flushed since a request last found it empty.
+    uint64_t hits;                      // stats.quick_hits[] at the last flush.
+} sf_quick_tune;
+
+/*
+ * An arena is an independent allocator: its own free lists, quick lists and lock,
+ * and its own heap segments.  A segment is a run of pages obtained from sf_mem_grow()
+ * that starts with a prologue and ends with an epilogue, laid out exactly like the
+ * original single heap.  While an arena owns the end of the heap it grows its last
+ * segment in place; once another arena has grown the heap it starts a new segment.
+ *
+ * Arena 0 uses sf_free_list_heads and sf_quick_lists; the others use their own copies.
+ *
+ * Each free list is kept grouped into NUM_SUB_LISTS runs of increasing block size,
+ * LIFO within a run.  The bitmaps and the first block of each run let insertion and
+ * find_free_block work in constant time, two-level segregated fit style.  Blocks above
+ * tree_threshold head their list instead and are found through a size-keyed tree.
+ *
+ * A thread freeing a block that belongs to another arena pushes it onto that arena's
+ * remote_frees stack instead of taking its lock.  The arena's own threads pop the whole
+ * stack and free the blocks in one batch on their next locked allocation.
+ */
+typedef struct sf_arena {
+    pthread_mutex_t lock;
+    bool initialized;                   // Lists set up by sf_init().
+    int threads;                        // Threads currently assigned to this arena.
+    char *heap_end;                     // End of the arena's last segment, or NULL.
+    sf_block *remote_frees;             // Blocks freed by other arenas' threads (lock-free stack).
+    sf_block *free_list_heads;          // NUM_FREE_LISTS sentinels.
+    uint32_t free_list_bitmap;          // Bit i set while free list i is non-empty.
+    uint32_t sub_list_bitmap[NUM_FREE_LISTS];                 // Bit j: sub-list j non-empty.
+    sf_block *sub_list_first[NUM_FREE_LISTS][NUM_SUB_LISTS];  // Newest block of each sub-list.
+    sf_block *tree_root;                // Free blocks above tree_threshold, by size (sfmm_tree.c).
+    sf_quick_list *quick_lists;         // NUM_QUICK_LISTS quick lists.
+    sf_quick_tune quick_tune[NUM_QUICK_LISTS];        // Capacity of each quick list.
+    struct sf_slab_run *slab_runs[NUM_SLAB_CLASSES];  // Runs with free objects, per class.
+    struct sf_slab_run *slab_empty;     // Runs with no objects allocated.
+    sf_block *unsorted;                 // Freed blocks awaiting coalescing (sfmm_defer.c).
+    size_t unsorted_size;               // Bytes in the unsorted bin.
+    sf_stats stats;                     // Counters for sf_get_stats(), see stat_add().
+    uint64_t allocated_bytes;           // Allocated heap blocks, cached ones included (stat_add()).
+    uint32_t size_counts[NUM_SIZE_COUNTS];          // Free blocks of each size up to SIZE_COUNT_LIMIT.
+    uint64_t size_bitmap[NUM_SIZE_COUNTS / 64];     // Bit i set while size_counts[i] is non-zero.
+    uint32_t size_summary;              // Bit w set while size_bitmap[w] is non-zero.
+    sf_block own_free_list_heads[NUM_FREE_LISTS];
+    sf_quick_list own_quick_lists[NUM_QUICK_LISTS];
+} sf_arena;
+
+/* Largest request a heap block can hold, as block and payload sizes are 32-bit fields. */
+#define MAX_HEAP_REQUEST ((size_t)UINT32_MAX - PAGE_SZ)
+
+/* The block size needed for a payload of size bytes. */
+static inline size_t block_size_for(size_t size) {
+    size_t aligned_size = (size + sizeof(sf_header) + ALLOCATED_FOOTER_SIZE + 15) & ~15;
+    return aligned_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : aligned_size;
+}
+
+/* Stores an allocated block's (un-obfuscated) header; its footer is never read. */
+static inline void set_allocated_header(sf_block *block, uint64_t header) {
+    block->header = header ^ MAGIC;
+}
+
+/* Stores a free block's (un-obfuscated) header and footer, unless it is too small for one. */
+static inline void set_free_header(sf_block *block, uint64_t header) {
+    size_t size = (uint32_t)header & ~0xF;
+    block->header = header ^ MAGIC;
+    if (size > sizeof(sf_header) + 2 * sizeof(uint32_t)) {
+        *(sf_footer *)((char *)block + size - sizeof(sf_footer)) = block->header;
+    }
+}
+
+/*
+ * Stores the header of an allocated block owned by a per-thread cache, which is done
+ * without the arena lock.  PREV_BLOCK_ALLOCATED is left as it is, since the block's
+ * neighbour may be changing it under the lock at the same time.
+ */
+static inline void set_unlocked_header(sf_block *block, uint64_t header) {
+    uint64_t old = __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+    uint64_t new;
+    do {
+        new = ((header & ~(uint64_t)PREV_BLOCK_ALLOCATED) | ((old ^ MAGIC) & PREV_BLOCK_ALLOCATED)) ^ MAGIC;
+    } while (!__atomic_compare_exchange_n(&block->header, &old, new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Updates PREV_BLOCK_ALLOCATED in a block's header, and in its footer if it is free.
+ * The block may be in a per-thread cache, so the header is updated atomically.
+ */
+static inline void set_prev_allocated(sf_block *block, bool allocated) {
+    uint64_t old = __atomic_load_n(&block->header, __ATOMIC_RELAXED);
+    uint64_t header;
+    do {
+        header = old ^ MAGIC;
+        header = allocated ? header | PREV_BLOCK_ALLOCATED : header & ~(uint64_t)PREV_BLOCK_ALLOCATED;
+    } while (!__atomic_compare_exchange_n(&block->header, &old, header ^ MAGIC, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    // Allocated blocks, the epilogue among them, have no footer to update
+    if ((header & THIS_BLOCK_ALLOCATED) == 0) {
+        set_free_header(block, header);
+    }
+}
+
+/*
+ * Free-list links.  Compact links are obfuscated like headers, and tagged in their low
+ * bits: LINK_BLOCK for a block, which always sits 8 bytes past a multiple of 16 from
+ * the heap start, and LINK_HEAD for one of the arena's list heads, which live outside
+ * the heap.  0 is NULL.
+ */
+#ifdef COMPACT_LINKS
+#define LINK_BLOCK 0x1
+#define LINK_HEAD  0x2
+
+static inline uint32_t link_encode(sf_arena *arena, sf_block *block) {
+    if (block == NULL) {
+        return 0;
+    }
+    if (block >= arena->free_list_heads && block < arena->free_list_heads + NUM_FREE_LISTS) {
+        return (uint32_t)((block - arena->free_list_heads) << 4) | LINK_HEAD;
+    }
+    return (uint32_t)((char *)block - (char *)sf_mem_start() - sizeof(sf_header)) | LINK_BLOCK;
+}
+
+static inline sf_block *link_decode(sf_arena *arena, uint32_t link) {
+    if (link == 0) {
+        return NULL;
+    }
+    if ((link & 0xF) == LINK_HEAD) {
+        return &arena->free_list_heads[link >> 4];
+    }
+    return (sf_block *)((char *)sf_mem_start() + (link & ~0xF) + sizeof(sf_header));
+}
+
+static inline uint32_t *links_of(sf_block *block) {
+    return (uint32_t *)&block->body;
+}
+
+static inline sf_block *free_list_next(sf_arena *arena, sf_block *block) {
+    return link_decode(arena, links_of(block)[0] ^ (uint32_t)MAGIC);
+}
+
+static inline sf_block *free_list_prev(sf_arena *arena, sf_block *block) {
+    return link_decode(arena, links_of(block)[1] ^ (uint32_t)MAGIC);
+}
+
+static inline void set_free_list_next(sf_arena *arena, sf_block *block, sf_block *next) {
+    links_of(block)[0] = link_encode(arena, next) ^ (uint32_t)MAGIC;
+}
+
+static inline void set_free_list_prev(sf_arena *arena, sf_block *block, sf_block *prev) {
+    links_of(block)[1] = link_encode(arena, prev) ^ (uint32_t)MAGIC;
+}
+#else
+static inline sf_block *free_list_next(sf_arena *arena, sf_block *block) {
+    return block->body.links.next;
+}
+
+static inline sf_block *free_list_prev(sf_arena *arena, sf_block *block) {
+    return block->body.links.prev;
+}
+
+static inline void set_free_list_next(sf_arena *arena, sf_block *block, sf_block *next) {
+    block->body.links.next = next;
+}
+
+static inline void set_free_list_prev(sf_arena *arena, sf_block *block, sf_block *prev) {
+    block->body.links.prev = prev;
+}
+#endif
+
+/*
+ * The size of the free block before this one, which must have PREV_BLOCK_ALLOCATED
+ * clear.  A free block's footer always carries PREV_BLOCK_ALLOCATED, whereas the
+ * links that take its place in a minimal compact block never look like that.
+ */
+static inline size_t prev_free_size(sf_block *block) {
+    uint64_t footer = *(sf_footer *)((char *)block - sizeof(sf_footer)) ^ MAGIC;
+#ifdef COMPACT_LINKS
+    if ((footer & 0xF) != PREV_BLOCK_ALLOCATED) {
+        return MIN_BLOCK_SIZE;
+    }
+#endif
+    return (uint32_t)footer & ~0xF;
+}
+
+/*
+ * Sorts a singly linked list of blocks, linked through body.links.next, by address
+ * (merge sort), so that neighbouring blocks can be merged in one pass.
+ */
+static inline sf_block *sort_blocks_by_address(sf_block *list) {
+    if (list == NULL || list->body.links.next == NULL) {
+        return list;
+    }
+
+    // Split the list in half
+    sf_block *slow = list;
+    sf_block *fast = list->body.links.next;
+    while (fast != NULL && fast->body.links.next != NULL) {
+        slow = slow->body.links.next;
+        fast = fast->body.links.next->body.links.next;
+    }
+    sf_block *half = slow->body.links.next;
+    slow->body.links.next = NULL;
+
+    sf_block *a = sort_blocks_by_address(list);
+    sf_block *b = sort_blocks_by_address(half);
+
+    sf_block head;
+    sf_block *tail = &head;
+    while (a != NULL && b != NULL) {
+        if (a < b) {
+            tail->body.links.next = a;
+            a = a->body.links.next;
+        } else {
+            tail->body.links.next = b;
+            b = b->body.links.next;
+        }
+        tail = tail->body.links.next;
+    }
+    tail->body.links.next = a != NULL ? a : b;
+    return head.body.links.next;
+}
+
+/*
+ * Adds n, which may be a wrapped negative value, to one of an arena's statistics.  Only
+ * the holder of the arena's lock writes them, but sf_get_stats() reads them without it,
+ * so the new value is stored atomically, without the cost of an atomic add.
+ */
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* sfmm.c: every function taking an arena expects the caller to hold arena->lock. */
+void sf_init(sf_arena *arena);
+int get_free_list_index(size_t size);
+void stat_live(sf_arena *arena, size_t size, int count);
+void insert_free_block(sf_arena *arena, sf_block *block);
+void remove_free_block(sf_arena *arena, sf_block *block);
+sf_block *find_free_block(sf_arena *arena, size_t size);
+void split_block(sf_arena *arena, sf_block *block, size_t requested_size, size_t payload_size);
+sf_block *coalesce_free_block(sf_arena *arena, sf_block *block);
+bool grow_arena(sf_arena *arena, size_t size);
+void adjust_payload(size_t delta);
+void *malloc_locked(sf_arena *arena, size_t size, bool *zeroed);
+void free_locked(sf_arena *arena, void *ptr);
+
+/* sfmm_arena.c */
+extern int sf_multithreaded;
+sf_arena *thread_arena(void);
+sf_arena *arena_of(void *ptr);
+void arena_lock(sf_arena *arena);
+void arena_unlock(sf_arena *arena);
+void arena_lock_all(void);
+void arena_unlock_all(void);
+bool arena_remote_free(sf_arena *arena, sf_block *block);
+void arena_drain_remote(sf_arena *arena);
+void *arena_mem_grow(sf_arena *arena, size_t *size, bool *in_place);
+size_t arena_heap_size(void);
+void arena_heap_release(size_t size);
+void arena_heap_reclaim(size_t size);
+size_t arena_peak_heap_size(void);
+sf_arena *arena_at(int index);
+bool arena_is_slab(void *ptr);
+void *arena_slab_page(sf_arena *arena);
+void arena_slab_unmark(void *page);
+int arena_set_count(int count);
+int arena_set_policy(int policy);
+
+/* sfmm_tree.c */
+extern size_t tree_threshold;
+void tree_insert(sf_arena *arena, sf_block *block);
+void tree_remove(sf_arena *arena, sf_block *block);
+sf_block *tree_best_fit(sf_arena *arena, size_t size);
+sf_block *tree_largest(sf_arena *arena);
+int tree_set_threshold(int threshold);
+
+/* sfmm_mmap.c */
+extern size_t mmap_threshold;
+void *mmap_malloc(size_t size);
+void *mmap_memalign(size_t align, size_t size);
+void mmap_free(sf_block *block);
+void *mmap_realloc(sf_block *block, size_t rsize);
+size_t mmap_usable_size(sf_block *block);
+
+/* Whether a request is big enough to get a mapping of its own. */
+static inline bool mmap_wanted(size_t size) {
+    return mmap_threshold != 0 && size > mmap_threshold;
+}
+
+/* sfmm_trim.c */
+extern size_t trim_threshold;
+void trim_reclaim(sf_block *block);
+void trim_tail(sf_arena *arena);
+bool trim_zero(void *start, size_t size);
+
+/* sfmm_slab.c */
+extern int slab_enabled;
+void *slab_malloc(sf_arena *arena, size_t size);
+bool slab_free(void *ptr);
+void slab_release(sf_arena *arena);
+void *slab_reclaim(sf_arena *arena);
+size_t slab_size(void *ptr);
+char *slab_skip(char *page, size_t *payload, size_t *allocated);
+
+/* sfmm_defer.c */
+extern size_t defer_threshold;
+void defer_free(sf_arena *arena, sf_block *block);
+sf_block *defer_take(sf_arena *arena, size_t size);
+bool defer_consolidate(sf_arena *arena);
+int defer_set_threshold(int threshold);
+
+/* sfmm_tcache.c */
+extern int tcache_count;
+void *tcache_malloc(sf_arena *arena, size_t size, size_t aligned_size);
+bool tcache_free(sf_arena *arena, sf_block *block, size_t block_size);
+void tcache_release(sf_arena *arena);
+void tcache_settle(void);
+void tcache_adjust_payload(size_t delta);
+
+/* The per-thread caches stay out of the way until a second thread shows up. */
+static inline bool tcache_enabled(void) {
+    return __atomic_load_n(&sf_multithreaded, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&tcache_count, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * sfmm_prof.c: built with -DPROFILE_LATENCY, the entry points time themselves with
+ * prof_begin() and prof_end(), and prof_path() reports the SF_PATH_* taken.  Otherwise
+ * these do nothing and compile away.
+ */
+#ifdef PROFILE_LATENCY
+uint64_t prof_begin(void);
+void prof_end(uint64_t start);
+void prof_path(int path);
+#else
+static inline uint64_t prof_begin(void) {
+    return 0;
+}
+
+static inline void prof_end(uint64_t start) {
+}
+
+static inline void prof_path(int path) {
+}
+#endif
+
+#endif
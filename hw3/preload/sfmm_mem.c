@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "sfmm.h"
+
+/*
+ * The heap of the shared library build, standing in for lib/sfutil.o.
+ *
+ * sfutil.o carves its pages out of a fixed 37-page buffer from the C library's malloc(),
+ * which the library is itself replacing.  Here the heap is one range of address space
+ * reserved with mmap() up front and handed out a page at a time; the kernel only backs
+ * a page with memory once it is touched.  The reservation stays under 4 GiB, so no heap
+ * block can outgrow the 32-bit size field of its header.
+ */
+
+#define MEM_RESERVE (((size_t)4 << 30) - PAGE_SZ)
+
+/* As in sfutil.o, set to silence the heap printers, which src/sfmm_show.c provides here. */
+int sf_util_quiet;
+
+static char *mem_start;
+static char *mem_end;
+static char *mem_limit;
+static sf_header magic;
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
+
+static void mem_init(void) {
+    // Settle for less address space if that much cannot be had
+    size_t size = MEM_RESERVE;
+    char *start = MAP_FAILED;
+    while (size >= PAGE_SZ) {
+        start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (start != MAP_FAILED) {
+            break;
+        }
+        size /= 2;
+    }
+
+    // As in sfutil.o, a random magic; read() rather than stdio, which would call malloc()
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &magic, sizeof(magic)) != sizeof(magic)) {
+        magic = (sf_header)time(NULL) * 0x9E3779B97F4A7C15ULL ^ (uintptr_t)&magic;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (start != MAP_FAILED) {
+        mem_start = mem_end = start;
+        __atomic_store_n(&mem_limit, start + size, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void mem_ready(void) {
+    if (__atomic_load_n(&mem_limit, __ATOMIC_ACQUIRE) == NULL) {
+        pthread_once(&mem_once, mem_init);
+    }
+}
+
+void *sf_mem_grow() {
+    mem_ready();
+    if (mem_end == NULL || (size_t)(mem_limit - mem_end) < PAGE_SZ) {
+        return NULL;
+    }
+    char *page = mem_end;
+    __atomic_store_n(&mem_end, page + PAGE_SZ, __ATOMIC_RELEASE);
+    return page;
+}
+
+void *sf_mem_start() {
+    mem_ready();
+    return mem_start;
+}
+
+void *sf_mem_end() {
+    mem_ready();
+    return __atomic_load_n(&mem_end, __ATOMIC_ACQUIRE);
+}
+
+sf_header sf_magic() {
+    mem_ready();
+    return magic;
+}
+
+void sf_set_magic(sf_header new_magic) {
+    mem_ready();
+    magic = new_magic;
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * The C library's allocator interface on top of sf_*, for LD_PRELOAD=bin/libsfmm.so.
+ *
+ * Everything in the library is hidden except the functions below, so the allocator's
+ * internals cannot clash with a program's own symbols.  The heap comes from sfmm_mem.c.
+ *
+ * The C library calls malloc() from places the allocator itself may be using, such as
+ * pthread_atfork().  A call made while the same thread is already inside the allocator
+ * is served from a small static buffer instead, whose blocks are never freed.
+ *
+ * Options can be set from the environment as SFMM_<option>=value, using the names of
+ * the SF_OPT_* constants (SFMM_ARENA_COUNT=8, say).  Unless set there, requests over
+ * 128 KiB get mappings of their own and free tail blocks over 128 KiB are trimmed, as
+ * with the C library's allocator, the heap grows 1 MiB at a time, and quick lists adapt
+ * their capacity up to 32 blocks.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+
+static __thread int depth = 0;
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+
+static const struct {
+    const char *name;
+    int param;
+    int value;
+} preload_options[] = {
+    {"SFMM_TCACHE_COUNT", SF_OPT_TCACHE_COUNT, -1},
+    {"SFMM_ARENA_COUNT", SF_OPT_ARENA_COUNT, -1},
+    {"SFMM_ARENA_POLICY", SF_OPT_ARENA_POLICY, -1},
+    {"SFMM_TREE_THRESHOLD", SF_OPT_TREE_THRESHOLD, -1},
+    {"SFMM_GROW_CHUNK", SF_OPT_GROW_CHUNK, 1024 * 1024},
+    {"SFMM_MMAP_THRESHOLD", SF_OPT_MMAP_THRESHOLD, 128 * 1024},
+    {"SFMM_TRIM_THRESHOLD", SF_OPT_TRIM_THRESHOLD, 128 * 1024},
+    {"SFMM_SLAB", SF_OPT_SLAB, -1},
+    {"SFMM_DEFER_COALESCE", SF_OPT_DEFER_COALESCE, -1},
+    {"SFMM_QUICK_LIST_MAX", SF_OPT_QUICK_LIST_MAX, 32},
+};
+
+/* A fork() must not happen while another thread holds an arena lock. */
+static void preload_prepare(void) {
+    arena_lock_all();
+}
+
+static void preload_release(void) {
+    arena_unlock_all();
+}
+
+static void preload_setup(void) {
+    for (size_t i = 0; i < sizeof(preload_options) / sizeof(preload_options[0]); i++) {
+        const char *value = getenv(preload_options[i].name);
+        if (value != NULL) {
+            sf_mallopt(preload_options[i].param, atoi(value));
+        } else if (preload_options[i].value >= 0) {
+            sf_mallopt(preload_options[i].param, preload_options[i].value);
+        }
+    }
+    pthread_atfork(preload_prepare, preload_release, preload_release);
+}
+
+/**
+ * Marks the calling thread as inside the allocator.
+ *
+ * @return false if it already was, in which case the call is served from the bootstrap
+ * buffer and preload_leave() is not called.
+ */
+static inline bool preload_enter(void) {
+    if (depth > 0) {
+        return false;
+    }
+    depth++;
+    pthread_once(&preload_once, preload_setup);
+    return true;
+}
+
+static inline void preload_leave(void) {
+    depth--;
+}
+
+/**
+ * Bump allocation from the bootstrap buffer.  Each block is preceded by 16 bytes ending
+ * in its size, so that realloc() knows how much to copy out of it.
+ */
+static void *bootstrap_malloc(size_t size) {
+    if (size > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + 15) & ~(size_t)15;
+    size_t offset = __atomic_fetch_add(&bootstrap_used, size + 16, __ATOMIC_RELAXED);
+    if (offset + size + 16 > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *ptr = bootstrap + offset + 16;
+    ((size_t *)ptr)[-1] = size;
+    return ptr;
+}
+
+static inline bool in_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static inline void *preload_result(void *ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size) {
+    if (!preload_enter()) {
+        return bootstrap_malloc(size);
+    }
+    // malloc(0) must return a pointer that can be freed, unlike sf_malloc(0)
+    void *ptr = sf_malloc(size != 0 ? size : 1);
+    preload_leave();
+    return preload_result(ptr);
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr == NULL || in_bootstrap(ptr)) {
+        return;
+    }
+    if (!preload_enter()) {
+        return;
+    }
+    sf_free(ptr);
+    preload_leave();
+}
+
+EXPORT void *calloc(size_t n, size_t size) {
+    if (n != 0 && size > SIZE_MAX / n) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!preload_enter()) {
+        // The bootstrap buffer has never been used, so it is all zeros
+        return bootstrap_malloc(n * size);
+    }
+    void *ptr = n == 0 || size == 0 ? sf_malloc(1) : sf_calloc(n, size);
+    preload_leave();
+    return preload_result(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (in_bootstrap(ptr)) {
+        void *new_ptr = malloc(size);
+        if (new_ptr != NULL) {
+            size_t old_size = ((size_t *)ptr)[-1];
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+        return new_ptr;
+    }
+    if (!preload_enter()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *new_ptr = ptr == NULL ? sf_malloc(size != 0 ? size : 1) : sf_realloc(ptr, size);
+    preload_leave();
+    return ptr != NULL && size == 0 ? NULL : preload_result(new_ptr);
+}
+
+EXPORT void *reallocarray(void *ptr, size_t n, size_t size) {
+    if (n != 0 && size > SIZE_MAX / n) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, n * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (!preload_enter()) {
+        return ENOMEM;
+    }
+    int result = sf_posix_memalign(memptr, align, size != 0 ? size : 1);
+    preload_leave();
+    return result;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size) {
+    if (!preload_enter()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = sf_aligned_alloc(align, size != 0 ? size : 1);
+    preload_leave();
+    if (ptr == NULL) {
+        errno = align == 0 || (align & (align - 1)) != 0 ? EINVAL : ENOMEM;
+    }
+    return ptr;
+}
+
+/* The obsolete interfaces still have to be covered, or their blocks would reach free(). */
+EXPORT void *memalign(size_t align, size_t size) {
+    // Unlike aligned_alloc(), any alignment is rounded up to a power of two
+    size_t power = 16;
+    while (power < align && power != 0) {
+        power <<= 1;
+    }
+    return aligned_alloc(power != 0 ? power : align, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned_alloc(PAGE_SZ, size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    return aligned_alloc(PAGE_SZ, (size + PAGE_SZ - 1) & ~(PAGE_SZ - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (in_bootstrap(ptr)) {
+        return ((size_t *)ptr)[-1];
+    }
+    return sf_malloc_usable_size(ptr);
+}
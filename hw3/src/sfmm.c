@@ -3,24 +3,34 @@
 #include <string.h>
 #include "debug.h"
 #include "sfmm.h"
-
-#define ENOMEM 12
-#define MIN_BLOCK_SIZE 32
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
 
 // **Function Prototypes** 
-void insert_free_block(sf_block *block);
-int get_free_list_index(size_t size);
-sf_block *find_free_block(size_t size);
-void split_block(sf_block *block, size_t requested_size, size_t size);
-void remove_free_block(sf_block *block);
-bool insert_into_quick_list(sf_block *block);
-void flush_quick_list(int index);
-sf_block *coalesce_free_block(sf_block *block);
+int get_sub_list_index(int index, size_t size);
+void split_block(sf_arena *arena, sf_block *block, size_t requested_size, size_t size);
+bool insert_into_quick_list(sf_arena *arena, sf_block *block);
+void flush_quick_list(sf_arena *arena, int index, int keep);
+static void quick_list_make_room(sf_arena *arena, int index);
+void create_heap(sf_arena *arena, void *page, size_t size, bool zeroed);
+bool grow_arena(sf_arena *arena, size_t size);
+void *realloc_in_place(sf_block *block, size_t aligned_size, size_t rsize);
+static void *malloc_entry(size_t size);
+static void free_entry(void *ptr);
+static void *realloc_entry(void *pp, size_t rsize);
+static void free_block(void *ptr);
 static inline size_t get_block_size(sf_block *block);
 static size_t current_payload = 0;
 static size_t peak_payload = 0;
-static size_t total_heap_size = 0;
 
+/* Fewest bytes the heap grows by at a time, a multiple of PAGE_SZ. */
+static size_t grow_chunk = PAGE_SZ;
+
+/* Most blocks a quick list may grow to; QUICK_LIST_MAX keeps sfmm.h's fixed lists. */
+static int quick_list_max = QUICK_LIST_MAX;
+
+/* Set by the first sf_calloc(): from then on, new heap pages are made known-zero. */
+static bool zero_fresh = false;
 
 
 static inline size_t get_block_size(sf_block *block) {
@@ -34,117 +44,150 @@ size_t get_payload_size(sf_block *block) {
 }
 
 /**
- * Initializes all free list heads (sentinel nodes) to point to themselves.
+ * Adds delta (which may be a wrapped negative value) to the current aggregate payload
+ * and updates the peak used by sf_utilization().
+ */
+void adjust_payload(size_t delta) {
+    size_t current = __atomic_add_fetch(&current_payload, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_payload, __ATOMIC_RELAXED);
+
+    // Per-thread caches settle their deltas late, so the total can briefly dip below zero
+    if ((int64_t)current < 0) {
+        return;
+    }
+
+    // Arenas update the totals under different locks, so the peak is raised with a CAS
+    while (current > peak &&
+           !__atomic_compare_exchange_n(&peak_payload, &peak, current, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Initializes all of an arena's free list heads (sentinel nodes) to point to themselves.
  * This must be called before inserting any free blocks.
  */
-void sf_init() {
+void sf_init(sf_arena *arena) {
     for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        sf_free_list_heads[i].body.links.next = &sf_free_list_heads[i];
-        sf_free_list_heads[i].body.links.prev = &sf_free_list_heads[i];
+        set_free_list_next(arena, &arena->free_list_heads[i], &arena->free_list_heads[i]);
+        set_free_list_prev(arena, &arena->free_list_heads[i], &arena->free_list_heads[i]);
     }
     for (int i = 0; i < NUM_QUICK_LISTS; i++) {
-        sf_quick_lists[i].length = 0;
-        sf_quick_lists[i].first = NULL;
+        arena->quick_lists[i].length = 0;
+        arena->quick_lists[i].first = NULL;
+        arena->quick_tune[i].capacity = QUICK_LIST_MAX;
+        arena->quick_tune[i].flushed = 0;
+        arena->quick_tune[i].hits = 0;
     }
+    arena->free_list_bitmap = 0;
+    memset(arena->sub_list_bitmap, 0, sizeof(arena->sub_list_bitmap));
+    memset(arena->sub_list_first, 0, sizeof(arena->sub_list_first));
+    arena->tree_root = NULL;
+    memset(arena->slab_runs, 0, sizeof(arena->slab_runs));
+    arena->slab_empty = NULL;
+    arena->unsorted = NULL;
+    arena->unsorted_size = 0;
 }
 
 /**
- * Flushes all blocks from a quick list at the given index.
+ * Flushes all but the newest blocks from a quick list at the given index.
  * Adds the blocks to the main free lists after clearing their quick list status.
+ * They go in address order, so blocks that were freed next to each other are merged
+ * into one before it is coalesced, instead of each going in and out of the free lists.
  * 
  * @param index The index of the quick list to flush
+ * @param keep The number of blocks to leave on the list, newest first
  */
-void flush_quick_list(int index) {
-    if (index < 0 || index >= NUM_QUICK_LISTS) {
+void flush_quick_list(sf_arena *arena, int index, int keep) {
+    if (index < 0 || index >= NUM_QUICK_LISTS || arena->quick_lists[index].length <= keep) {
         return;
     }
 
-    sf_block *block = sf_quick_lists[index].first;
+    sf_block *block = arena->quick_lists[index].first;
     sf_block *next = NULL;
 
+    if (keep > 0) {
+        sf_block *last_kept = block;
+        for (int i = 1; i < keep; i++) {
+            last_kept = last_kept->body.links.next;
+        }
+        block = last_kept->body.links.next;
+        last_kept->body.links.next = NULL;
+    } else {
+        arena->quick_lists[index].first = NULL;
+    }
+    arena->quick_lists[index].length = keep;
+
+    if (block != NULL) {
+        stat_add(&arena->stats.quick_flushes[index], 1);
+    }
+
+    block = sort_blocks_by_address(block);
     while (block != NULL) {
+        size_t block_size = get_block_size(block);
         next = block->body.links.next;
 
-        // 1) De-obfuscate
-        uint64_t temp = block->header ^ MAGIC;
+        // Blocks that follow on directly are merged before the free lists see them
+        while (next != NULL && (char *)next == (char *)block + block_size) {
+            block_size += get_block_size(next);
+            next = next->body.links.next;
+        }
 
-        // 2) Extract the block size from the low 28 bits
-        size_t block_size = ((size_t)temp & 0xFFFFFFFFUL) & ~0xF; 
+        // Rebuild a free-block header (payload bits cleared) and coalesce it into the free lists
+        stat_add(&arena->allocated_bytes, -block_size);
+        set_free_header(block, block_size | ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED));
+        coalesce_free_block(arena, block);
 
-        // 3) Build a new free-block header: top 32 bits = 0, bottom 28 bits = block_size
-        uint64_t new_header = (uint64_t)block_size;  // This zeroes out the top half
+        block = next;
+    }
+}
 
-        // 4) Obfuscate and store
-        block->header = new_header ^ MAGIC;
+/* The number of blocks a quick list holds before quick_list_make_room() flushes it. */
+static inline int quick_list_capacity(sf_arena *arena, int index) {
+    int capacity = arena->quick_tune[index].capacity;
+    return capacity < quick_list_max ? capacity : quick_list_max;
+}
 
-        // 5) Write the identical footer
-        sf_footer *footer = (sf_footer *)((char *)block + block_size - sizeof(sf_footer));
-        *footer = block->header;
-
-
-        sf_block *prev_block = NULL;
-        sf_block *next_block = NULL;
-        bool prev_free = false;
-        bool next_free = false;
-
-        // Check previous block
-        if ((char *)block > (char *)sf_mem_start()) {
-            sf_footer *prev_footer = (sf_footer *)((char *)block - sizeof(sf_footer));
-            if (((void *)prev_footer >= sf_mem_start())) {
-                uint64_t prev_footer_val = *prev_footer ^ MAGIC;
-                size_t prev_size = (uint32_t)prev_footer_val & ~0xF;
-                prev_block = (sf_block *)((char *)block - prev_size);
-                prev_free = ((prev_footer_val & THIS_BLOCK_ALLOCATED) == 0);
-            }
-        }
+/**
+ * Flushes a full quick list so that one more block fits.
+ *
+ * With quick_list_max at QUICK_LIST_MAX the whole list goes, as sfmm.h describes.  Above
+ * it, only the oldest half does, so the blocks most likely to be asked for again stay
+ * cached.  A list none of whose blocks was reused since it was last flushed only fills
+ * up, and its capacity is halved back towards QUICK_LIST_MAX; quick_list_missed() grows
+ * it again.
+ */
+static void quick_list_make_room(sf_arena *arena, int index) {
+    if (quick_list_max <= QUICK_LIST_MAX) {
+        flush_quick_list(arena, index, 0);
+        return;
+    }
 
-        // Check next block
-        next_block = (sf_block *)((char *)block + block_size);
-        if ((char *)next_block < (char *)sf_mem_end()) {
-            uint64_t next_header_val = next_block->header ^ MAGIC;
-            next_free = ((next_header_val & THIS_BLOCK_ALLOCATED) == 0);
-        }
+    sf_quick_tune *tune = &arena->quick_tune[index];
+    uint64_t hits = arena->stats.quick_hits[index];
+    if (hits == tune->hits && tune->capacity > QUICK_LIST_MAX) {
+        tune->capacity = tune->capacity / 2 < QUICK_LIST_MAX ? QUICK_LIST_MAX : tune->capacity / 2;
+    }
+    tune->hits = hits;
 
-        if (prev_free && next_free) {
-            remove_free_block(prev_block);
-            remove_free_block(next_block);
-
-            size_t new_size = get_block_size(prev_block) + block_size + get_block_size(next_block);
-            uint64_t header = ((uint64_t)0 << 32) | (new_size & ~0xF);
-            prev_block->header = header ^ MAGIC;
-            sf_footer *new_footer = (sf_footer *)((char *)prev_block + new_size - sizeof(sf_footer));
-            *new_footer = header ^ MAGIC;
-
-            insert_free_block(prev_block);
-        } else if (prev_free) {
-            remove_free_block(prev_block);
-
-            size_t new_size = get_block_size(prev_block) + block_size;
-            uint64_t header = ((uint64_t)0 << 32) | (new_size & ~0xF);
-            prev_block->header = header ^ MAGIC;
-            sf_footer *new_footer = (sf_footer *)((char *)prev_block + new_size - sizeof(sf_footer));
-            *new_footer = header ^ MAGIC;
-
-            insert_free_block(prev_block);
-        } else if (next_free) {
-            remove_free_block(next_block);
-
-            size_t new_size = block_size + get_block_size(next_block);
-            uint64_t header = ((uint64_t)0 << 32) | (new_size & ~0xF);
-            block->header = header ^ MAGIC;
-            sf_footer *new_footer = (sf_footer *)((char *)block + new_size - sizeof(sf_footer));
-            *new_footer = header ^ MAGIC;
-
-            insert_free_block(block);
-        } else {
-            insert_free_block(block);
-        }
+    int length = arena->quick_lists[index].length;
+    tune->flushed += length - length / 2;
+    flush_quick_list(arena, index, length / 2);
+}
 
-        block = next;
-    }
+/**
+ * Notes a request that found a quick list empty.  If the list flushed blocks since the
+ * last such miss, they were wanted again sooner than the list could keep them, so its
+ * capacity doubles, up to quick_list_max.
+ */
+static void quick_list_missed(sf_arena *arena, int index) {
+    sf_quick_tune *tune = &arena->quick_tune[index];
+    stat_add(&arena->stats.quick_misses[index], 1);
 
-    sf_quick_lists[index].first = NULL;
-    sf_quick_lists[index].length = 0;
+    if (tune->flushed > 0) {
+        tune->capacity = tune->capacity > quick_list_max / 2 ? quick_list_max : tune->capacity * 2;
+        tune->flushed = 0;
+    }
 }
 
 
@@ -153,28 +196,24 @@ void flush_quick_list(int index) {
  * Returns true if the block was successfully added to a quick list,
  * false if the block was too large for any quick list.
  */
-bool insert_into_quick_list(sf_block *block) {
+bool insert_into_quick_list(sf_arena *arena, sf_block *block) {
     size_t block_size = get_block_size(block);
 
-    if (block_size <= MIN_BLOCK_SIZE + (NUM_QUICK_LISTS - 1) * 16) {
-        int index = (block_size - MIN_BLOCK_SIZE) / 16;
+    if (block_size <= QUICK_LIST_LIMIT) {
+        int index = QUICK_LIST_INDEX(block_size);
 
         if (index >= 0 && index < NUM_QUICK_LISTS) {
-            if (sf_quick_lists[index].length >= QUICK_LIST_MAX) {
-                flush_quick_list(index);
+            if (arena->quick_lists[index].length >= quick_list_capacity(arena, index)) {
+                quick_list_make_room(arena, index);
             }
 
-            // Create encoded header with IN_QUICK_LIST and THIS_BLOCK_ALLOCATED bits set, payload size = 0
-            uint64_t new_header = ((uint64_t)0 << 32) | block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST;
-            block->header = new_header ^ MAGIC;
+            // Create header with IN_QUICK_LIST and THIS_BLOCK_ALLOCATED bits set, payload size = 0
+            uint64_t prev_allocated = (block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED;
+            set_allocated_header(block, block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST | prev_allocated);
 
-            // Encode footer the same way
-            sf_footer *footer = (sf_footer *)((char *)block + block_size - sizeof(sf_footer));
-            *footer = block->header;
-
-            block->body.links.next = sf_quick_lists[index].first;
-            sf_quick_lists[index].first = block;
-            sf_quick_lists[index].length++;
+            block->body.links.next = arena->quick_lists[index].first;
+            arena->quick_lists[index].first = block;
+            arena->quick_lists[index].length++;
 
             return true;
         }
@@ -185,44 +224,33 @@ bool insert_into_quick_list(sf_block *block) {
 
 
 /**
- * Initializes the heap and sets up the free list.
+ * Lays out a new heap segment, starting at the given page, for an arena:
+ * padding, prologue, one free block covering the rest of the page, and the epilogue.
+ * zeroed says whether the pages are known to hold only zeros.
  */
-void create_heap() {
-    sf_init();
-
-    if (sf_mem_start() != sf_mem_end()) {
-        return;
-    }
-
+void create_heap(sf_arena *arena, void *page, size_t size, bool zeroed) {
     // Set magic to 0x0 only for debugging
     //sf_set_magic(0x0);
 
-    void *heap_start = sf_mem_grow();
-    if (heap_start == NULL) {
-        sf_errno = ENOMEM;
-        return;
-    }
-
-    total_heap_size += PAGE_SZ;
-
     int padding_size = 0;
-    if ((uintptr_t)sf_mem_start() % 16 == 0) {
+    if ((uintptr_t)page % 16 == 0) {
         padding_size += 8;
     }
 
-    // Setup prologue block
-    sf_block *prologue = (sf_block *)((uintptr_t)sf_mem_start() + padding_size);
-    prologue->header = (32 | THIS_BLOCK_ALLOCATED) ^ MAGIC; // obfuscated
+    // Setup prologue block, of the minimum block size
+    sf_block *prologue = (sf_block *)((uintptr_t)page + padding_size);
+    prologue->header = (MIN_BLOCK_SIZE | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED) ^ MAGIC; // obfuscated
     // Write footer for prologue to prevent invalid prev_footer reads
-    sf_footer *prologue_footer = (sf_footer *)((char *)prologue + 32 - sizeof(sf_footer));
+    sf_footer *prologue_footer = (sf_footer *)((char *)prologue + MIN_BLOCK_SIZE - sizeof(sf_footer));
     *prologue_footer = prologue->header;
 
 
-    size_t free_block_size = PAGE_SZ - padding_size - 32 - 8;
+    size_t free_block_size = size - padding_size - MIN_BLOCK_SIZE - 8;
 
     // Setup initial free block
-    sf_block *first_block = (sf_block *)((char *)prologue + 32);
-    first_block->header = ((uint64_t)0 << 32 | (free_block_size & ~0xF)) ^ MAGIC; // obfuscated
+    sf_block *first_block = (sf_block *)((char *)prologue + MIN_BLOCK_SIZE);
+    first_block->header = ((uint64_t)0 << 32 | (free_block_size & ~0xF) | PREV_BLOCK_ALLOCATED |
+                           (zeroed ? KNOWN_ZERO : 0)) ^ MAGIC; // obfuscated
 
     sf_footer *footer = (sf_footer *)((char *)first_block + free_block_size - sizeof(sf_footer));
     *footer = first_block->header; // footer identical, obfuscated
@@ -231,38 +259,187 @@ void create_heap() {
     sf_block *epilogue = (sf_block *)((char *)first_block + free_block_size);
     epilogue->header = (0 | THIS_BLOCK_ALLOCATED) ^ MAGIC; // obfuscated
 
-    insert_free_block(first_block);
+    insert_free_block(arena, first_block);
+    stat_add(&arena->allocated_bytes, MIN_BLOCK_SIZE);
+}
+
+
+/**
+ * Grows an arena by one page.  The page either extends the arena's last segment,
+ * turning the old epilogue into a free block coalesced with any free block before it,
+ * or starts a new segment.
+ *
+ * @return false if the heap could not be grown.
+ */
+bool grow_arena(sf_arena *arena, size_t size) {
+    // Only the shortfall is needed if the arena's free tail block will absorb the new pages
+    size_t wanted = size + 8 + MIN_BLOCK_SIZE + 8;  // A new segment also needs padding, prologue and epilogue
+    if (arena->heap_end != NULL && arena->heap_end == (char *)sf_mem_end()) {
+        size_t tail_size = 0;
+        sf_block *epilogue = (sf_block *)(arena->heap_end - sizeof(sf_header));
+        if (((epilogue->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
+            tail_size = prev_free_size(epilogue);
+        }
+        wanted = size > tail_size ? size - tail_size : 0;
+    }
+    wanted = (wanted + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ;
+    if (wanted < grow_chunk) {
+        wanted = grow_chunk;
+    }
+
+    bool in_place;
+    char *new_page = arena_mem_grow(arena, &wanted, &in_place);
+    if (new_page == NULL) {
+        // Out of heap: an empty slab run can still become an ordinary segment
+        new_page = slab_reclaim(arena);
+        if (new_page == NULL) {
+            return false;
+        }
+        create_heap(arena, new_page, PAGE_SZ, false);
+        return true;
+    }
+
+    // Only worth the trouble once sf_calloc() is in use
+    uint64_t zeroed = 0;
+    if (__atomic_load_n(&zero_fresh, __ATOMIC_RELAXED) && trim_zero(new_page, wanted)) {
+        zeroed = KNOWN_ZERO;
+    }
+
+    if (!in_place) {
+        create_heap(arena, new_page, wanted, zeroed != 0);
+        return true;
+    }
+
+    sf_block *old_epilogue = (sf_block *)(new_page - sizeof(sf_header));
+    sf_block *new_epilogue = (sf_block *)(new_page + wanted - sizeof(sf_header));
+    new_epilogue->header = (0 | THIS_BLOCK_ALLOCATED) ^ MAGIC;  // ✅ Obfuscated epilogue
+
+    size_t new_block_size = wanted;
+
+    //  FIX #2: Coalesce with the previous block if the old epilogue says it is free
+    if (((old_epilogue->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) == 0) {
+        size_t prev_block_size = prev_free_size(old_epilogue);
+
+        sf_block *prev_block = (sf_block *)((char *)old_epilogue - prev_block_size);
+        zeroed &= prev_block->header ^ MAGIC;
+        remove_free_block(arena, prev_block);
+
+        // The old footer and epilogue end up inside the block, the only words of it not zero
+        if (zeroed) {
+            old_epilogue->header = 0;
+            if (prev_block_size >= ZERO_KEEP + sizeof(sf_footer)) {
+                *(sf_footer *)((char *)old_epilogue - sizeof(sf_footer)) = 0;
+            }
+        }
+
+        size_t combined_size = prev_block_size + new_block_size;
+        uint64_t new_header = ((uint64_t)0 << 32) | (combined_size & ~0xF) | PREV_BLOCK_ALLOCATED | zeroed;
+        prev_block->header = new_header ^ MAGIC;
+
+        sf_footer *new_footer = (sf_footer *)((char *)prev_block + combined_size - sizeof(sf_footer));
+        *new_footer = new_header ^ MAGIC;
+
+        insert_free_block(arena, prev_block);
+        return true;
+    }
+
+    // No previous coalesce, just turn old_epilogue into a free block
+    old_epilogue->header = (((uint64_t)0 << 32) | (new_block_size & ~0xF) | PREV_BLOCK_ALLOCATED | zeroed) ^ MAGIC;
+    sf_footer *footer = (sf_footer *)((char *)old_epilogue + new_block_size - sizeof(sf_footer));
+    *footer = old_epilogue->header;
+
+    insert_free_block(arena, old_epilogue);
+    return true;
+}
+
+
+/**
+ * Adds delta to the count of free blocks of the given size, keeping the bitmaps over
+ * the counts in step.  Sizes above SIZE_COUNT_LIMIT are not counted.
+ */
+static void size_count_add(sf_arena *arena, size_t size, int delta) {
+    if (size > SIZE_COUNT_LIMIT) {
+        return;
+    }
+
+    size_t slot = size / 16 - 1;
+    int word = slot / 64;
+    arena->size_counts[slot] += delta;
+    if (arena->size_counts[slot] != 0) {
+        arena->size_bitmap[word] |= 1ul << (slot % 64);
+    } else {
+        arena->size_bitmap[word] &= ~(1ul << (slot % 64));
+    }
+    if (arena->size_bitmap[word] != 0) {
+        arena->size_summary |= 1u << word;
+    } else {
+        arena->size_summary &= ~(1u << word);
+    }
 }
 
 
 /**
  * Inserts a free block into the correct free list based on size class.
  * */
-void insert_free_block(sf_block *block) {
+void insert_free_block(sf_arena *arena, sf_block *block) {
     size_t size = get_block_size(block);
 
-    // === Add this ===
-    uint64_t raw_header = ((uint64_t)0 << 32) | (size & ~0xF);
-    block->header = raw_header ^ MAGIC;
+    // Free blocks are always fully coalesced, so the block before this one is allocated
+    set_free_header(block, ((uint64_t)0 << 32) | (size & ~0xF) | PREV_BLOCK_ALLOCATED |
+                           ((block->header ^ MAGIC) & KNOWN_ZERO));
 
-    sf_footer *footer = (sf_footer *)((char *)block + size - sizeof(sf_footer));
-    *footer = raw_header ^ MAGIC;
+    set_prev_allocated((sf_block *)((char *)block + size), false);
 
     int index = get_free_list_index(size);
-    sf_block *head = &sf_free_list_heads[index];
 
-    if (block->body.links.next != NULL || block->body.links.prev != NULL) {
+    stat_add(&arena->stats.free_blocks[index], 1);
+    stat_add(&arena->stats.free_bytes[index], size);
+    size_count_add(arena, size, 1);
+    if (size > arena->stats.largest_free) {
+        __atomic_store_n(&arena->stats.largest_free, size, __ATOMIC_RELAXED);
+    }
+
+    // Large blocks are looked up through the tree and simply head their free list
+    if (size > tree_threshold) {
+        sf_block *head = &arena->free_list_heads[index];
+        set_free_list_next(arena, block, free_list_next(arena, head));
+        set_free_list_prev(arena, block, head);
+        set_free_list_prev(arena, free_list_next(arena, head), block);
+        set_free_list_next(arena, head, block);
+        tree_insert(arena, block);
         return;
     }
 
-    block->body.links.next = head->body.links.next;
-    block->body.links.prev = head;
+    int sub_index = get_sub_list_index(index, size);
 
-    if (head->body.links.next != NULL) {
-        head->body.links.next->body.links.prev = block;
+    // Goes in front of the newest block of its own sub-list, or of the next non-empty
+    // sub-list up, so each free list stays grouped by sub-list in ascending order
+    sf_block *successor = arena->sub_list_first[index][sub_index];
+    if (successor == NULL) {
+        uint32_t higher = arena->sub_list_bitmap[index] & (~0u << (sub_index + 1));
+        successor = higher ? arena->sub_list_first[index][__builtin_ctz(higher)]
+                           : &arena->free_list_heads[index];
     }
 
-    head->body.links.next = block;
+    set_free_list_next(arena, block, successor);
+    set_free_list_prev(arena, block, free_list_prev(arena, successor));
+    set_free_list_next(arena, free_list_prev(arena, successor), block);
+    set_free_list_prev(arena, successor, block);
+
+    arena->sub_list_first[index][sub_index] = block;
+    arena->sub_list_bitmap[index] |= 1u << sub_index;
+    arena->free_list_bitmap |= 1u << index;
+}
+
+
+/**
+ * Counts count blocks of the given size as allocated, or as no longer allocated if count
+ * is negative (see sf_stats).  Caller holds arena->lock.
+ */
+void stat_live(sf_arena *arena, size_t size, int count) {
+    int index = get_free_list_index(size);
+    stat_add(&arena->stats.live_blocks[index], (uint64_t)(int64_t)count);
+    stat_add(&arena->stats.live_bytes[index], (uint64_t)((int64_t)count * (int64_t)size));
 }
 
 
@@ -270,63 +447,187 @@ void insert_free_block(sf_block *block) {
  * Returns the index of the free list based on block size.
  */
 int get_free_list_index(size_t size) {
-    int index = 0;
-    size_t block_size = MIN_BLOCK_SIZE;
+    if (size <= MIN_BLOCK_SIZE) {
+        return 0;
+    }
+
+    // Free list i holds sizes in (M*2^(i-1), M*2^i]
+    int index = 64 - __builtin_clzl((size - 1) >> __builtin_ctz(MIN_BLOCK_SIZE));
+    return index < NUM_FREE_LISTS - 1 ? index : NUM_FREE_LISTS - 1;
+}
 
-    while (index < NUM_FREE_LISTS - 1 && size > block_size) {
-        block_size *= 2;
-        index++;
+
+/**
+ * Returns the sub-list a block belongs to within free list index.  Each list's range
+ * (L, 2L] is cut into NUM_SUB_LISTS equal slices.  The last list has no upper bound,
+ * so its sub-lists double in size instead, with the final one open-ended.
+ */
+int get_sub_list_index(int index, size_t size) {
+    if (index == 0) {
+        return 0;
     }
-    return index;
+
+    size_t lower = (size_t)MIN_BLOCK_SIZE << (index - 1);
+    if (index == NUM_FREE_LISTS - 1) {
+        int sub_index = 63 - __builtin_clzl((size - 1) / lower);
+        return sub_index < NUM_SUB_LISTS - 1 ? sub_index : NUM_SUB_LISTS - 1;
+    }
+    return (size - lower - 1) / (lower / NUM_SUB_LISTS);
 }
 
 
-void remove_free_block(sf_block *block) {
+/**
+ * @return The size of the arena's largest free block: the rightmost in the tree, or
+ * else the largest size with a free count.  Only when tree_threshold has been raised
+ * past SIZE_COUNT_LIMIT can the sub-lists hold bigger blocks, and then the highest
+ * non-empty one is searched, as find_free_block() does.  Caller holds arena->lock.
+ */
+static size_t largest_free_size(sf_arena *arena) {
+    sf_block *block = tree_largest(arena);
+    if (block != NULL) {
+        return get_block_size(block);
+    }
+    if (arena->free_list_bitmap == 0) {
+        return 0;
+    }
+
+    int index = 31 - __builtin_clz(arena->free_list_bitmap);
+    if (index < NUM_FREE_LISTS - 1) {
+        int word = 31 - __builtin_clz(arena->size_summary);
+        return ((size_t)word * 64 + 63 - __builtin_clzl(arena->size_bitmap[word]) + 1) * 16;
+    }
+
+    int sub_index = 31 - __builtin_clz(arena->sub_list_bitmap[index]);
+    sf_block *head = &arena->free_list_heads[index];
+    size_t largest = 0;
+    for (sf_block *curr = arena->sub_list_first[index][sub_index];
+         curr != head && get_sub_list_index(index, get_block_size(curr)) == sub_index;
+         curr = free_list_next(arena, curr)) {
+        if (get_block_size(curr) > largest) {
+            largest = get_block_size(curr);
+        }
+    }
+    return largest;
+}
+
+
+/**
+ * Takes a block off its free list and sub-list, or out of the tree.
+ *
+ * @return false if the block was not on a free list.
+ */
+static bool unlink_free_block(sf_arena *arena, sf_block *block) {
     if (block == NULL) {
-        return;
+        return false;
+    }
+
+    sf_block *prev = free_list_prev(arena, block);
+    sf_block *next = free_list_next(arena, block);
+
+    if (prev == NULL || next == NULL || free_list_next(arena, prev) != block || free_list_prev(arena, next) != block) {
+        return false;
     }
 
-    sf_block *prev = block->body.links.prev;
-    sf_block *next = block->body.links.next;
+    set_free_list_next(arena, prev, next);
+    set_free_list_prev(arena, next, prev);
+
+    set_free_list_next(arena, block, NULL);
+    set_free_list_prev(arena, block, NULL);
+
+    if ((block->header ^ MAGIC) & PAGES_RELEASED) {
+        trim_reclaim(block);
+    }
+
+    size_t size = get_block_size(block);
+    if (size > tree_threshold) {
+        tree_remove(arena, block);
+        return true;
+    }
+
+    int index = get_free_list_index(size);
+    int sub_index = get_sub_list_index(index, size);
+
+    if (arena->sub_list_first[index][sub_index] != block) {
+        return true;
+    }
+
+    // The block was the newest of its sub-list; the next one takes over if it is a member.
+    // Tree blocks sit at the front of the list, so they never follow a sub-list's run.
+    if (next != &arena->free_list_heads[index] &&
+        get_sub_list_index(index, get_block_size(next)) == sub_index) {
+        arena->sub_list_first[index][sub_index] = next;
+        return true;
+    }
 
-    if (prev == NULL || next == NULL || prev->body.links.next != block || next->body.links.prev != block) {
+    arena->sub_list_first[index][sub_index] = NULL;
+    arena->sub_list_bitmap[index] &= ~(1u << sub_index);
+    if (arena->sub_list_bitmap[index] == 0) {
+        arena->free_list_bitmap &= ~(1u << index);
+    }
+    return true;
+}
+
+
+void remove_free_block(sf_arena *arena, sf_block *block) {
+    if (!unlink_free_block(arena, block)) {
         return;
     }
 
-    prev->body.links.next = next;
-    next->body.links.prev = prev;
+    size_t size = get_block_size(block);
+    int index = get_free_list_index(size);
+    stat_add(&arena->stats.free_blocks[index], -1);
+    stat_add(&arena->stats.free_bytes[index], -size);
 
-    block->body.links.next = NULL;
-    block->body.links.prev = NULL;
+    size_count_add(arena, size, -1);
+    if (size == arena->stats.largest_free) {
+        __atomic_store_n(&arena->stats.largest_free, largest_free_size(arena), __ATOMIC_RELAXED);
+    }
 }
 
 
 /**
- * Searches for a free block in the free lists.
+ * Searches for a free block in the free lists.  Apart from the open-ended top sub-list,
+ * this never walks a list: every block in a higher sub-list is known to be big enough,
+ * and the bitmaps say which one is the closest non-empty.  Blocks above tree_threshold
+ * are only in the tree, which gives the best fit; they are all bigger than anything in
+ * the sub-lists, so the tree is only consulted once the sub-lists come up empty.
  */
-sf_block *find_free_block(size_t size) {
-    int index = get_free_list_index(size);
-
-    for (; index < NUM_FREE_LISTS; index++) {
-        sf_block *head = &sf_free_list_heads[index];
+sf_block *find_free_block(sf_arena *arena, size_t size) {
+    if (size > tree_threshold) {
+        return tree_best_fit(arena, size);
+    }
 
-        for (sf_block *curr = head->body.links.next; curr != head; curr = curr->body.links.next) {
-            // Decode header safely
-            uint64_t header = curr->header ^ MAGIC;
-            size_t block_size = (uint32_t)(header) & ~0xF;
+    int index = get_free_list_index(size);
+    int sub_index = get_sub_list_index(index, size);
 
-            // Validate block size and free status
-            if ((header & THIS_BLOCK_ALLOCATED) != 0 || (block_size < MIN_BLOCK_SIZE)) {
-                continue; // skip invalid or allocated blocks
-            }
+    // The newest block of the request's own sub-list may still be big enough
+    sf_block *block = arena->sub_list_first[index][sub_index];
+    if (block != NULL && get_block_size(block) >= size) {
+        return block;
+    }
 
-            if (block_size >= size) {
+    // The top sub-list has no upper bound, so its blocks have to be checked one by one
+    if (block != NULL && index == NUM_FREE_LISTS - 1 && sub_index == NUM_SUB_LISTS - 1) {
+        sf_block *head = &arena->free_list_heads[index];
+        for (sf_block *curr = free_list_next(arena, block); curr != head; curr = free_list_next(arena, curr)) {
+            if (get_block_size(curr) >= size) {
                 return curr;
             }
         }
+        return tree_best_fit(arena, size);
+    }
+
+    uint32_t sub_map = arena->sub_list_bitmap[index] & (~0u << (sub_index + 1));
+    if (sub_map == 0) {
+        uint32_t map = arena->free_list_bitmap & (~0u << (index + 1));
+        if (map == 0) {
+            return tree_best_fit(arena, size);
+        }
+        index = __builtin_ctz(map);
+        sub_map = arena->sub_list_bitmap[index];
     }
 
-    return NULL;
+    return arena->sub_list_first[index][__builtin_ctz(sub_map)];
 }
 
 
@@ -335,33 +636,38 @@ sf_block *find_free_block(size_t size) {
  * Splits a free block if it is larger than the requested size.
  * The leftover portion is reinserted into the free list.
  */
-void split_block(sf_block *block, size_t requested_size, size_t payload_size) {
+void split_block(sf_arena *arena, sf_block *block, size_t requested_size, size_t payload_size) {
     //printf("DEBUG: ENTERING SPLIT BLOCK\n");
     size_t block_size = get_block_size(block);
     size_t leftover = block_size - requested_size;
+    uint64_t prev_allocated = (block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED;
+    uint64_t zeroed = (block->header ^ MAGIC) & KNOWN_ZERO;
 
-    remove_free_block(block);
+    remove_free_block(arena, block);
 
     if (leftover >= MIN_BLOCK_SIZE) {
+        stat_add(&arena->stats.splits, 1);
         sf_block *new_block = (sf_block *)((char *)block + requested_size);
-        new_block->header = (((uint64_t)0 << 32) | (leftover & ~0xF)) ^ MAGIC;
+        new_block->header = (((uint64_t)0 << 32) | (leftover & ~0xF) | PREV_BLOCK_ALLOCATED | zeroed) ^ MAGIC;
 
         sf_footer *new_footer = (sf_footer *)((char *)new_block + leftover - sizeof(sf_footer));
         *new_footer = new_block->header;
 
-        insert_free_block(new_block);
+        insert_free_block(arena, new_block);
+    } else {
+        // Too small to stand alone, so the splinter stays inside the allocated block
+        stat_add(&arena->stats.splinters_avoided, 1);
+        requested_size = block_size;
+        set_prev_allocated((sf_block *)((char *)block + block_size), true);
     }
+    stat_live(arena, requested_size, 1);
+    stat_add(&arena->allocated_bytes, requested_size);
 
-    // Create obfuscated header with payload size in top 32 bits
-    uint64_t header = ((uint64_t)payload_size << 32) | requested_size | THIS_BLOCK_ALLOCATED;
-    block->header = header ^ MAGIC;
+    // Create header with payload size in top 32 bits
+    uint64_t header = ((uint64_t)payload_size << 32) | requested_size | THIS_BLOCK_ALLOCATED | prev_allocated;
+    set_allocated_header(block, header);
 
-    sf_footer *footer = (sf_footer *)((char *)block + requested_size - sizeof(sf_footer));
-    *footer = block->header;
-
-    current_payload += payload_size;
-    if (current_payload > peak_payload)
-        peak_payload = current_payload;
+    adjust_payload(payload_size);
 
     //printf("[DEBUG MALLOC] The payload pointer shows: %zu bytes\n", payload_size);
     //printf("[DEBUG] THE TOTAL SIZE IS : %zu\n", requested_size);
@@ -370,28 +676,137 @@ void split_block(sf_block *block, size_t requested_size, size_t payload_size) {
 
 
 void *sf_malloc(size_t size) {
+    uint64_t start = prof_begin();
+    void *ptr = malloc_entry(size);
+    prof_end(start);
+    return ptr;
+}
+
+
+/**
+ * The body of sf_malloc, apart from the latency profiling.
+ */
+static void *malloc_entry(size_t size) {
     if (size == 0) {
         return NULL;
     }
 
-    if (sf_mem_start() == sf_mem_end()) {
-        create_heap();
+    if (mmap_wanted(size)) {
+        prof_path(SF_PATH_MALLOC_MMAP);
+        return mmap_malloc(size);
+    }
+    if (size > MAX_HEAP_REQUEST) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t aligned_size = block_size_for(size);
+
+    sf_arena *arena = thread_arena();
+
+    if (slab_enabled && size <= SLAB_MAX_SIZE) {
+        void *ptr = slab_malloc(arena, size);
+        if (ptr != NULL) {
+            prof_path(SF_PATH_MALLOC_SLAB);
+            return ptr;
+        }
+    }
+
+    // Small requests are served from the calling thread's cache without taking the lock
+    if (aligned_size <= QUICK_LIST_LIMIT) {
+        void *ptr = tcache_malloc(arena, size, aligned_size);
+        if (ptr != NULL) {
+            prof_path(SF_PATH_MALLOC_TCACHE);
+            return ptr;
+        }
+    }
+
+    arena_lock(arena);
+    void *ptr = malloc_locked(arena, size, NULL);
+    arena_unlock(arena);
+    return ptr;
+}
+
+
+void *sf_calloc(size_t n, size_t size) {
+    if (n == 0 || size == 0) {
+        return NULL;
+    }
+    if (size > SIZE_MAX / n) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size *= n;
+
+    if (!__atomic_load_n(&zero_fresh, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&zero_fresh, true, __ATOMIC_RELAXED);
     }
 
-    size_t total_size = size + sizeof(sf_header) + sizeof(sf_footer);
-    size_t aligned_size = (total_size + 15) & ~15;
-    if (aligned_size < 32) {
-        aligned_size = 32;
+    // A fresh mapping is all zeros already
+    if (mmap_wanted(size)) {
+        return mmap_malloc(size);
+    }
+    if (size > MAX_HEAP_REQUEST) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_arena *arena = thread_arena();
+    void *ptr = NULL;
+    bool zeroed = false;
+
+    // Slab objects and cached blocks have always been used before
+    if (slab_enabled && size <= SLAB_MAX_SIZE) {
+        ptr = slab_malloc(arena, size);
+    }
+    if (ptr == NULL) {
+        arena_lock(arena);
+        ptr = malloc_locked(arena, size, &zeroed);
+        arena_unlock(arena);
+        if (ptr == NULL) {
+            return NULL;
+        }
+    }
+
+    if (!zeroed) {
+        memset(ptr, 0, size);
+        return ptr;
+    }
+
+    // Only the free block's bookkeeping needs clearing: its first words and old footer
+    sf_block *block = (sf_block *)((char *)ptr - sizeof(sf_header));
+    char *end = (char *)ptr + size;
+    char *keep_end = (char *)block + ZERO_KEEP;
+    memset(ptr, 0, (keep_end < end ? keep_end : end) - (char *)ptr);
+
+    char *footer = (char *)block + get_block_size(block) - sizeof(sf_footer);
+    if (footer < end) {
+        memset(footer, 0, end - footer);
+    }
+    return ptr;
+}
+
+
+/**
+ * The body of sf_malloc.  The caller must hold arena->lock.
+ *
+ * @param zeroed If not NULL, set to whether the block was cut from a known-zero free
+ * block (see KNOWN_ZERO).
+ */
+void *malloc_locked(sf_arena *arena, size_t size, bool *zeroed) {
+    size_t aligned_size = block_size_for(size);
+    if (zeroed != NULL) {
+        *zeroed = false;
     }
 
     // FIX #3: Try to use quick list first — validate block before using
-    if (aligned_size <= MIN_BLOCK_SIZE + (NUM_QUICK_LISTS - 1) * 16) {
-        int quick_list_index = (aligned_size - MIN_BLOCK_SIZE) / 16;
+    if (aligned_size <= QUICK_LIST_LIMIT) {
+        int quick_list_index = QUICK_LIST_INDEX(aligned_size);
         if (quick_list_index >= 0 && quick_list_index < NUM_QUICK_LISTS) {
-            if (sf_quick_lists[quick_list_index].length > 0) {
-                sf_block *quick_block = sf_quick_lists[quick_list_index].first;
-                sf_quick_lists[quick_list_index].first = quick_block->body.links.next;
-                sf_quick_lists[quick_list_index].length--;
+            if (arena->quick_lists[quick_list_index].length > 0) {
+                sf_block *quick_block = arena->quick_lists[quick_list_index].first;
+                arena->quick_lists[quick_list_index].first = quick_block->body.links.next;
+                arena->quick_lists[quick_list_index].length--;
 
                 // Validate quick block's header
                 uint64_t quick_header = quick_block->header ^ MAGIC;
@@ -399,152 +814,224 @@ void *sf_malloc(size_t size) {
                     abort(); // corrupted quick list block
                 }
 
-                // Clear IN_QUICK_LIST bit and re-obfuscate
-                quick_header &= ~IN_QUICK_LIST;
-                quick_block->header = quick_header ^ MAGIC;
+                // Clear IN_QUICK_LIST bit, record the payload size and re-obfuscate
+                quick_header = ((uint64_t)size << 32) | (quick_header & 0xFFFFFFFFUL & ~IN_QUICK_LIST);
+                set_allocated_header(quick_block, quick_header);
 
+                adjust_payload(size);
+                stat_add(&arena->stats.quick_hits[quick_list_index], 1);
+                stat_live(arena, aligned_size, 1);
+
+                prof_path(SF_PATH_MALLOC_QUICK);
                 return (void *)((char *)quick_block + sizeof(sf_header));
             }
+            quick_list_missed(arena, quick_list_index);
         }
     }
 
-    sf_block *block = find_free_block(aligned_size);
+    // Blocks other threads freed into this arena rejoin the free lists before searching
+    arena_drain_remote(arena);
+
+    // A block still waiting to be coalesced is reused as it is if it fits
+    sf_block *block = defer_take(arena, aligned_size);
+    if (block != NULL) {
+        uint64_t header = ((uint64_t)size << 32) | get_block_size(block) | THIS_BLOCK_ALLOCATED |
+                          ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED);
+        set_allocated_header(block, header);
+        adjust_payload(size);
+        stat_add(&arena->stats.free_list_hits[get_free_list_index(get_block_size(block))], 1);
+        stat_live(arena, get_block_size(block), 1);
+        prof_path(SF_PATH_MALLOC_FIT);
+        return (void *)((char *)block + sizeof(sf_header));
+    }
+
+    block = find_free_block(arena, aligned_size);
+    if (block == NULL && defer_consolidate(arena)) {
+        block = find_free_block(arena, aligned_size);
+    }
+    bool grown = false;
     while (block == NULL) {
-        void *new_page = sf_mem_grow();
-        if (new_page == NULL) {
+        if (!grow_arena(arena, aligned_size)) {
             sf_errno = ENOMEM;
             return NULL;
         }
+        grown = true;
+        block = find_free_block(arena, aligned_size);
+    }
 
-        total_heap_size += PAGE_SZ;
+    prof_path(grown ? SF_PATH_MALLOC_GROW :
+              get_block_size(block) - aligned_size >= MIN_BLOCK_SIZE ? SF_PATH_MALLOC_SPLIT : SF_PATH_MALLOC_FIT);
+    if (!grown) {
+        stat_add(&arena->stats.free_list_hits[get_free_list_index(get_block_size(block))], 1);
+    }
 
-        sf_block *old_epilogue = (sf_block *)((char *)sf_mem_end() - PAGE_SZ - sizeof(sf_header));
-        sf_block *new_epilogue = (sf_block *)((char *)sf_mem_end() - sizeof(sf_header));
-        new_epilogue->header = (0 | THIS_BLOCK_ALLOCATED) ^ MAGIC;  // ✅ Obfuscated epilogue
+    if (zeroed != NULL) {
+        *zeroed = ((block->header ^ MAGIC) & KNOWN_ZERO) != 0;
+    }
 
-        size_t new_block_size = PAGE_SZ;
+    // Block found, split and allocate
+    split_block(arena, block, aligned_size, size);  // Handles obfuscation internally
 
-        //  FIX #2: Proper coalescing with previous block using obfuscated footer
-        sf_footer *prev_footer = (sf_footer *)((char *)old_epilogue - sizeof(sf_footer));
-        if ((void *)prev_footer >= sf_mem_start()) {
-            uint64_t footer_val = *prev_footer ^ MAGIC;
-            size_t prev_block_size = (uint32_t)(footer_val) & ~0xF;
+    // Footer already written inside split_block
+    return (void *)((char *)block + sizeof(sf_header));
+}
 
-            sf_block *prev_block = (sf_block *)((char *)old_epilogue - prev_block_size);
-            uint64_t prev_header = prev_block->header ^ MAGIC;
 
-            if (footer_val == prev_header) {
-                remove_free_block(prev_block);
 
-                size_t combined_size = prev_block_size + new_block_size;
-                uint64_t new_header = ((uint64_t)0 << 32) | (combined_size & ~0xF);
-                prev_block->header = new_header ^ MAGIC;
+void sf_free(void *ptr) {
+    uint64_t start = prof_begin();
+    free_entry(ptr);
+    prof_end(start);
+}
 
-                sf_footer *new_footer = (sf_footer *)((char *)prev_block + combined_size - sizeof(sf_footer));
-                *new_footer = new_header ^ MAGIC;
 
-                insert_free_block(prev_block);
-                block = find_free_block(aligned_size);
-                continue;
-            }
-        }
+/**
+ * The body of sf_free, apart from the latency profiling.
+ */
+static void free_entry(void *ptr) {
+    //printf("[ENTERS FREE]\n");
+    if (ptr == NULL) return;
 
-        // No previous coalesce, just turn old_epilogue into a free block
-        old_epilogue->header = (((uint64_t)0 << 32) | (new_block_size & ~0xF)) ^ MAGIC;
-        sf_footer *footer = (sf_footer *)((char *)old_epilogue + new_block_size - sizeof(sf_footer));
-        *footer = old_epilogue->header;
+    // Slab objects have no header, so they are recognised by address first
+    if (slab_free(ptr)) {
+        prof_path(SF_PATH_FREE_SLAB);
+        return;
+    }
+
+    free_block(ptr);
+}
 
-        insert_free_block(old_epilogue);
-        block = find_free_block(aligned_size);
+
+void sf_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+
+    // A slab object is never bigger than SLAB_MAX_SIZE, so larger ones skip the lookup
+    if (size <= SLAB_MAX_SIZE && slab_free(ptr)) {
+        prof_path(SF_PATH_FREE_SLAB);
+        return;
     }
 
-    // Block found, split and allocate
-    split_block(block, aligned_size, size);  // Handles obfuscation internally
+#ifndef TRUST_SIZED_FREE
+    // The size must lie between the one requested and the one sf_malloc_usable_size() gave
+    sf_block *block = (sf_block *)((char *)ptr - sizeof(sf_header));
+    uint64_t header = block->header ^ MAGIC;
+    size_t usable_size = header & MMAPPED ? mmap_usable_size(block) : USABLE_SIZE((uint32_t)header & ~0xF);
+    if ((header & (THIS_BLOCK_ALLOCATED | IN_QUICK_LIST)) != THIS_BLOCK_ALLOCATED ||
+        size < (header >> 32) || size > usable_size) {
+        abort(); // wrong size or not an allocated block
+    }
+#endif
 
-    // Footer already written inside split_block
-    return (void *)((char *)block + sizeof(sf_header));
+    free_block(ptr);
 }
 
 
+size_t sf_malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
 
-void sf_free(void *ptr) {
-    //printf("[ENTERS FREE]\n");
-    if (ptr == NULL) return;
+    size_t object_size = slab_size(ptr);
+    if (object_size != 0) {
+        return object_size;
+    }
+
+    sf_block *block = (sf_block *)((char *)ptr - sizeof(sf_header));
+    if ((block->header ^ MAGIC) & MMAPPED) {
+        return mmap_usable_size(block);
+    }
+    return USABLE_SIZE(get_block_size(block));
+}
+
+
+/**
+ * The part of sf_free after slab objects have been ruled out.
+ */
+static void free_block(void *ptr) {
+    sf_block *block = (sf_block *)((char *)ptr - sizeof(sf_header));
+    if ((block->header ^ MAGIC) & MMAPPED) {
+        prof_path(SF_PATH_FREE_MMAP);
+        mmap_free(block);
+        return;
+    }
 
+    size_t block_size = get_block_size(block);
+    sf_arena *arena = arena_of(ptr);
+
+    if (arena != thread_arena()) {
+        // Another arena's block is queued for its owner rather than taking the owner's lock
+        if (arena_remote_free(arena, block)) {
+            prof_path(SF_PATH_FREE_REMOTE);
+            return;
+        }
+    } else if (block_size <= QUICK_LIST_LIMIT && tcache_free(arena, block, block_size)) {
+        // Small blocks go back to the calling thread's cache without taking the lock
+        prof_path(SF_PATH_FREE_TCACHE);
+        return;
+    }
+
+    arena_lock(arena);
+    free_locked(arena, ptr);
+    trim_tail(arena);
+    arena_unlock(arena);
+}
+
+
+/**
+ * The body of sf_free.  The caller must hold arena->lock.
+ */
+void free_locked(sf_arena *arena, void *ptr) {
     sf_block *block = (sf_block *)((char *)ptr - sizeof(sf_header));
     uint64_t unmasked_header = block->header ^ MAGIC;
     size_t block_size = (uint32_t)(unmasked_header) & ~0xF;
 
     // Subtract payload from current_payload
     size_t payload_size = unmasked_header >> 32;
-    current_payload -= payload_size;
+    adjust_payload(-payload_size);
+    stat_live(arena, block_size, -1);
 
     // Check if eligible for quick list
-    if (block_size <= MIN_BLOCK_SIZE + (NUM_QUICK_LISTS - 1) * 16) {
+    if (block_size <= QUICK_LIST_LIMIT) {
         //printf("QUICKLIST\n");
-        int quick_list_index = (block_size - MIN_BLOCK_SIZE) / 16;
+        int quick_list_index = QUICK_LIST_INDEX(block_size);
 
         if (quick_list_index >= 0 && quick_list_index < NUM_QUICK_LISTS) {
-            if (sf_quick_lists[quick_list_index].length >= QUICK_LIST_MAX) {
-                sf_block *curr = sf_quick_lists[quick_list_index].first;
-                while (curr != NULL) {
-                    sf_block *next = curr->body.links.next;
-
-                    // 1) De-obfuscate the header
-                    uint64_t temp = curr->header ^ MAGIC;
-                    // 2) Extract block size from the bottom 32 bits
-                    size_t block_size = (temp & ~0xF);
-
-                    // 3) Build a new free-block header (top 32 bits=0, bottom 28 bits=block_size)
-                    uint64_t new_header = (uint64_t)block_size; // Wipes out old payload bits
-                    curr->header = new_header ^ MAGIC;
-
-                    // 4) Write the identical footer
-                    sf_footer *footer = (sf_footer*)((char*)curr + block_size - sizeof(sf_footer));
-                    *footer = curr->header;
-
-                    // 5) Now coalesce + insert into main free list
-                    coalesce_free_block(curr);
-
-                    curr = next;
-                }
-
-                // Finally, reset the quick list
-                sf_quick_lists[quick_list_index].first = NULL;
-                sf_quick_lists[quick_list_index].length = 0;
+            prof_path(SF_PATH_FREE_QUICK);
+            if (arena->quick_lists[quick_list_index].length >= quick_list_capacity(arena, quick_list_index)) {
+                prof_path(SF_PATH_FREE_FLUSH);
+                quick_list_make_room(arena, quick_list_index);
             }
 
 
-            // Store obfuscated header and footer
-            uint64_t new_header = (((uint64_t)0 << 32) | block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST) ^ MAGIC;
-            block->header = new_header;
-
-            sf_footer *footer = (sf_footer *)((char *)block + block_size - sizeof(sf_footer));
-            *footer = new_header;
+            // Store obfuscated header and footer; the flush above may have freed the block before this one
+            uint64_t new_header = ((uint64_t)0 << 32) | block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST |
+                                  ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED);
+            set_allocated_header(block, new_header);
 
-            block->body.links.next = sf_quick_lists[quick_list_index].first;
-            sf_quick_lists[quick_list_index].first = block;
-            sf_quick_lists[quick_list_index].length++;
+            block->body.links.next = arena->quick_lists[quick_list_index].first;
+            arena->quick_lists[quick_list_index].first = block;
+            arena->quick_lists[quick_list_index].length++;
             return;
         }
     }
     //printf("Not small enought for quicklist\n");
 
-    // Coalescing logic
-    sf_footer *prev_footer = (sf_footer *)((char *)block - sizeof(sf_footer));
-    //printf("AFter getting SF FOOTER\n");
-    bool prev_free = false;
-    //printf("Bool free\n");
+    if (defer_threshold != 0) {
+        prof_path(SF_PATH_FREE_DEFER);
+        defer_free(arena, block);
+        return;
+    }
+
+    stat_add(&arena->allocated_bytes, -block_size);
+
+    // Coalescing logic; the previous block only has a footer to read if it is free
+    bool prev_free = (unmasked_header & PREV_BLOCK_ALLOCATED) == 0;
     size_t prev_size = 0;
-    //printf("after the size\n");
     sf_block *prev_block = NULL;
-    //printf("After prevblock null shii\n");
 
-    if ((void *)prev_footer >= (sf_mem_start() + 8)) {
-        uint64_t unmasked_footer = *prev_footer ^ MAGIC;
-        prev_size = (uint32_t)(unmasked_footer) & ~0xF;
+    if (prev_free) {
+        prev_size = prev_free_size(block);
         prev_block = (sf_block *)((char *)block - prev_size);
-        prev_free = ((unmasked_footer & THIS_BLOCK_ALLOCATED) == 0);
     }
 
 
@@ -554,10 +1041,14 @@ void sf_free(void *ptr) {
     bool next_free = ((char *)next_block < (char *)sf_mem_end()) &&
                      ((next_header_unmasked & THIS_BLOCK_ALLOCATED) == 0);
 
+    prof_path(prev_free ? (next_free ? SF_PATH_FREE_BOTH : SF_PATH_FREE_PREV) :
+              (next_free ? SF_PATH_FREE_NEXT : SF_PATH_FREE_ALONE));
+
     if (prev_free && next_free) {
         //printf("prev and next if\n");
-        remove_free_block(prev_block);
-        remove_free_block(next_block);
+        stat_add(&arena->stats.coalesce_both, 1);
+        remove_free_block(arena, prev_block);
+        remove_free_block(arena, next_block);
 
         size_t new_size = prev_size + block_size + next_size;
         uint64_t new_header = (((uint64_t)0 << 32) | new_size) ^ MAGIC;
@@ -566,11 +1057,12 @@ void sf_free(void *ptr) {
         sf_footer *new_footer = (sf_footer *)((char *)prev_block + new_size - sizeof(sf_footer));
         *new_footer = new_header;
 
-        insert_free_block(prev_block);
+        insert_free_block(arena, prev_block);
     } else if (prev_free) {
                 //printf("prev if\n");
 
-        remove_free_block(prev_block);
+        stat_add(&arena->stats.coalesce_prev, 1);
+        remove_free_block(arena, prev_block);
 
         size_t new_size = prev_size + block_size;
         uint64_t new_header = (((uint64_t)0 << 32) | new_size) ^ MAGIC;
@@ -579,11 +1071,12 @@ void sf_free(void *ptr) {
         sf_footer *new_footer = (sf_footer *)((char *)prev_block + new_size - sizeof(sf_footer));
         *new_footer = new_header;
 
-        insert_free_block(prev_block);
+        insert_free_block(arena, prev_block);
     } else if (next_free) {
                 //printf("next if\n");
 
-        remove_free_block(next_block);
+        stat_add(&arena->stats.coalesce_next, 1);
+        remove_free_block(arena, next_block);
 
         size_t new_size = block_size + next_size;
         uint64_t new_header = (((uint64_t)0 << 32) | new_size) ^ MAGIC;
@@ -592,23 +1085,123 @@ void sf_free(void *ptr) {
         sf_footer *new_footer = (sf_footer *)((char *)block + new_size - sizeof(sf_footer));
         *new_footer = new_header;
 
-        insert_free_block(block);
+        insert_free_block(arena, block);
     } else {
                 //printf("NONE\n");
         // No coalescing
+        stat_add(&arena->stats.coalesce_none, 1);
         uint64_t new_header = (((uint64_t)0 << 32) | block_size) ^ MAGIC;
 
         block->header = new_header;
         sf_footer *footer = (sf_footer *)((char *)block + block_size - sizeof(sf_footer));
         *footer = new_header;
 
-        insert_free_block(block);
+        insert_free_block(arena, block);
     }
     //printf("Leaving FREE\n");
 }
 
 
+/**
+ * Tries to grow an allocated block without moving its payload elsewhere: first by
+ * absorbing the free block after it, extending the heap if the block sits at the
+ * arena's tail, then by also absorbing a free block before it and sliding the
+ * payload down with memmove.
+ *
+ * @return The payload pointer, or NULL if the neighbours are not big enough.
+ */
+void *realloc_in_place(sf_block *block, size_t aligned_size, size_t rsize) {
+    sf_arena *arena = arena_of(block);
+    arena_lock(arena);
+
+    uint64_t header = block->header ^ MAGIC;
+    size_t size = (uint32_t)header & ~0xF;
+    size_t old_payload_size = header >> 32;
+
+    sf_block *next = (sf_block *)((char *)block + size);
+    uint64_t next_header = next->header ^ MAGIC;
+    size_t next_size = (next_header & THIS_BLOCK_ALLOCATED) ? 0 : ((uint32_t)next_header & ~0xF);
+
+    // At the tail of the heap the pages can come straight after the block
+    if (size + next_size < aligned_size && (char *)next + next_size + sizeof(sf_header) == arena->heap_end &&
+        arena->heap_end == (char *)sf_mem_end() && grow_arena(arena, aligned_size - size)) {
+        next_header = next->header ^ MAGIC;
+        next_size = (next_header & THIS_BLOCK_ALLOCATED) ? 0 : ((uint32_t)next_header & ~0xF);
+    }
+
+    stat_live(arena, size, -1);
+
+    uint64_t prev_allocated = header & PREV_BLOCK_ALLOCATED;
+    if (size + next_size >= aligned_size) {
+        remove_free_block(arena, next);
+        size += next_size;
+    } else {
+        size_t prev_size = 0;
+        if ((header & PREV_BLOCK_ALLOCATED) == 0) {
+            prev_size = prev_free_size(block);
+        }
+        if (prev_size + size + next_size < aligned_size) {
+            stat_live(arena, size, 1);
+            arena_unlock(arena);
+            return NULL;
+        }
+
+        sf_block *prev = (sf_block *)((char *)block - prev_size);
+        remove_free_block(arena, prev);
+        if (next_size > 0) {
+            remove_free_block(arena, next);
+        }
+
+        // The whole usable size moves, in case the caller has written past its request
+        memmove((char *)prev + sizeof(sf_header), (char *)block + sizeof(sf_header), USABLE_SIZE(size));
+        prev_allocated = PREV_BLOCK_ALLOCATED;
+        block = prev;
+        size += prev_size + next_size;
+    }
+
+    // Hand back whatever the request does not need
+    size_t leftover = size - aligned_size;
+    if (leftover < MIN_BLOCK_SIZE) {
+        stat_add(&arena->stats.splinters_avoided, 1);
+        aligned_size = size;
+        set_prev_allocated((sf_block *)((char *)block + size), true);
+    } else {
+        stat_add(&arena->stats.splits, 1);
+    }
+    stat_live(arena, aligned_size, 1);
+    stat_add(&arena->allocated_bytes, aligned_size - ((uint32_t)header & ~0xF));
+
+    header = ((uint64_t)rsize << 32) | aligned_size | THIS_BLOCK_ALLOCATED | prev_allocated;
+    set_allocated_header(block, header);
+
+    if (leftover >= MIN_BLOCK_SIZE) {
+        sf_block *rest = (sf_block *)((char *)block + aligned_size);
+        rest->header = ((uint64_t)leftover | PREV_BLOCK_ALLOCATED) ^ MAGIC;
+        sf_footer *rest_footer = (sf_footer *)((char *)rest + leftover - sizeof(sf_footer));
+        *rest_footer = rest->header;
+        coalesce_free_block(arena, rest);
+    }
+
+    adjust_payload(rsize - old_payload_size);
+
+    arena_unlock(arena);
+    return (void *)((char *)block + sizeof(sf_header));
+}
+
+
 void *sf_realloc(void *pp, size_t rsize) {
+    uint64_t start = prof_begin();
+    void *ptr = realloc_entry(pp, rsize);
+    prof_end(start);
+    return ptr;
+}
+
+
+/**
+ * The body of sf_realloc, apart from the latency profiling.  Where it calls sf_malloc or
+ * sf_free, those report their own paths unless it reports one afterwards.
+ */
+static void *realloc_entry(void *pp, size_t rsize) {
     if (pp == NULL) {
         return sf_malloc(rsize);
     }
@@ -618,84 +1211,146 @@ void *sf_realloc(void *pp, size_t rsize) {
         return NULL;
     }
 
+    size_t object_size = slab_size(pp);
+    if (object_size != 0) {
+        if (rsize <= object_size) {
+            prof_path(SF_PATH_REALLOC_SHRINK);
+            return pp;
+        }
+        void *ptr = sf_malloc(rsize);
+        if (ptr != NULL) {
+            memcpy(ptr, pp, object_size);
+            sf_free(pp);
+            prof_path(SF_PATH_REALLOC_MOVE);
+        }
+        return ptr;
+    }
+
     sf_block *current_block = (sf_block *)((char *)pp - sizeof(sf_header));
     uint64_t unmasked_header = current_block->header ^ MAGIC;
     size_t current_block_size = (uint32_t)(unmasked_header) & ~0xF;
 
-    size_t total_size = rsize + sizeof(sf_header) + sizeof(sf_footer);
-    size_t aligned_size = (total_size + 15) & ~15;
-    if (aligned_size < MIN_BLOCK_SIZE) {
-        aligned_size = MIN_BLOCK_SIZE;
+    if (unmasked_header & MMAPPED) {
+        prof_path(SF_PATH_REALLOC_MMAP);
+        return mmap_realloc(current_block, rsize);
+    }
+    if (rsize > MAX_HEAP_REQUEST && !mmap_wanted(rsize)) {
+        sf_errno = ENOMEM;
+        return NULL;
     }
 
+    size_t aligned_size = block_size_for(rsize);
+
     if (aligned_size > current_block_size) {
+        if (!mmap_wanted(rsize)) {
+            void *ptr = realloc_in_place(current_block, aligned_size, rsize);
+            if (ptr != NULL) {
+                prof_path(SF_PATH_REALLOC_EXTEND);
+                return ptr;
+            }
+        }
+
         void *new_ptr = sf_malloc(rsize);
         if (new_ptr == NULL) {
             return NULL;
         }
 
-        size_t old_payload_size = unmasked_header >> 32;
-        size_t copy_size = (rsize < old_payload_size) ? rsize : old_payload_size;
+        size_t old_usable_size = USABLE_SIZE(current_block_size);
+        size_t copy_size = (rsize < old_usable_size) ? rsize : old_usable_size;
         memcpy(new_ptr, pp, copy_size);
 
-        current_payload += rsize;
-
         sf_free(pp);
+        prof_path(SF_PATH_REALLOC_MOVE);
         return new_ptr;
     }
 
     // New size fits, maybe split
+    prof_path(SF_PATH_REALLOC_SHRINK);
     size_t leftover = current_block_size - aligned_size;
 
+    sf_arena *arena = arena_of(pp);
+    arena_lock(arena);
+
+    // A neighbour may have changed PREV_BLOCK_ALLOCATED before the lock was taken
+    uint64_t prev_allocated = (current_block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED;
+
     if (leftover < MIN_BLOCK_SIZE) {
         // No split, just adjust payload size in header
+        stat_add(&arena->stats.splinters_avoided, 1);
         size_t old_payload_size = unmasked_header >> 32;
-        current_payload -= old_payload_size;
-        current_payload += rsize;
-
-        uint64_t new_header = ((uint64_t)rsize << 32) | current_block_size | THIS_BLOCK_ALLOCATED;
-        current_block->header = new_header ^ MAGIC;
+        adjust_payload(rsize - old_payload_size);
 
-        sf_footer *footer = (sf_footer *)((char *)current_block + current_block_size - sizeof(sf_footer));
-        *footer = current_block->header;
+        uint64_t new_header = ((uint64_t)rsize << 32) | current_block_size | THIS_BLOCK_ALLOCATED |
+                              prev_allocated;
+        set_allocated_header(current_block, new_header);
 
+        arena_unlock(arena);
         return pp;
     }
 
     // We can split
     size_t old_payload_size = unmasked_header >> 32;
-    current_payload -= old_payload_size;
-    current_payload += rsize;
+    adjust_payload(rsize - old_payload_size);
+    stat_add(&arena->stats.splits, 1);
+    stat_live(arena, current_block_size, -1);
+    stat_live(arena, aligned_size, 1);
+    stat_add(&arena->allocated_bytes, aligned_size - current_block_size);
 
     // Allocated block header
-    uint64_t new_header = ((uint64_t)rsize << 32) | aligned_size | THIS_BLOCK_ALLOCATED;
-    current_block->header = new_header ^ MAGIC;
-
-    sf_footer *allocated_footer = (sf_footer *)((char *)current_block + aligned_size - sizeof(sf_footer));
-    *allocated_footer = current_block->header;
+    uint64_t new_header = ((uint64_t)rsize << 32) | aligned_size | THIS_BLOCK_ALLOCATED |
+                          prev_allocated;
+    set_allocated_header(current_block, new_header);
 
     // Free split block
     sf_block *new_free_block = (sf_block *)((char *)current_block + aligned_size);
     size_t new_free_size = current_block_size - aligned_size;
 
-    uint64_t free_header = ((uint64_t)0 << 32) | (new_free_size & ~0xF);
+    uint64_t free_header = ((uint64_t)0 << 32) | (new_free_size & ~0xF) | PREV_BLOCK_ALLOCATED;
     new_free_block->header = free_header ^ MAGIC;
 
     sf_footer *new_free_footer = (sf_footer *)((char *)new_free_block + new_free_size - sizeof(sf_footer));
     *new_free_footer = free_header ^ MAGIC;  //  Make footer match header exactly
 
-    insert_free_block(new_free_block);
-    coalesce_free_block(new_free_block);
+    coalesce_free_block(arena, new_free_block);
 
+    arena_unlock(arena);
     return pp;
 }
 
+/**
+ * Payload over the size of every allocated block, from totals kept as blocks change
+ * hands: current_payload, and each arena's allocated_bytes.  Blocks on a quick list or
+ * per-thread cache and the prologues count as allocated, with no payload, as they do in
+ * sf_fragmentation_walk().  The calling thread's cache settles first; other live
+ * threads' caches settle on their next refill or drain, so their latest calls may be
+ * missing.
+ */
 double sf_fragmentation() {
+    tcache_settle();
+
+    size_t total_allocated = 0;
+    sf_arena *arena;
+    for (int i = 0; (arena = arena_at(i)) != NULL; i++) {
+        total_allocated += __atomic_load_n(&arena->allocated_bytes, __ATOMIC_RELAXED);
+    }
+
+    // Per-thread caches settle their payload late, so the total can briefly dip below zero
+    size_t total_payload = __atomic_load_n(&current_payload, __ATOMIC_RELAXED);
+    if (total_allocated == 0 || (int64_t)total_payload < 0) {
+        return 0.0;
+    }
+    return (double)total_payload / total_allocated;
+}
+
+
+double sf_fragmentation_walk() {
     size_t total_payload = 0;
     size_t total_allocated = 0;
 
-    char *heap_ptr = (char *)sf_mem_start() + 8; // skip padding
+    arena_lock_all();
+
     char *heap_end = (char *)sf_mem_end();
+    char *heap_ptr = slab_skip(sf_mem_start(), &total_payload, &total_allocated) + 8; // skip padding
 
     while (heap_ptr + sizeof(sf_header) < heap_end) {
         sf_block *block = (sf_block *)heap_ptr;
@@ -704,6 +1359,15 @@ double sf_fragmentation() {
         uint64_t header = block->header ^ MAGIC;
         size_t block_size = (uint32_t)(header) & ~0xF;
 
+        // An epilogue short of the heap end is followed by another arena's segment
+        if (block_size == 0 && (header & THIS_BLOCK_ALLOCATED)) {
+            heap_ptr = slab_skip(heap_ptr + sizeof(sf_header), &total_payload, &total_allocated);
+            if ((uintptr_t)heap_ptr % 16 == 0) {
+                heap_ptr += 8; // skip the next segment's padding
+            }
+            continue;
+        }
+
         // Defensive: break if invalid block size or overflows
         if (block_size == 0 || heap_ptr + block_size > heap_end) {
             break;
@@ -717,6 +1381,8 @@ double sf_fragmentation() {
         heap_ptr += block_size;
     }
 
+    arena_unlock_all();
+
     if (total_allocated == 0){
         return 0.0;
         //printf("[TOTAL ALLOC IS 0]\n");
@@ -730,6 +1396,7 @@ double sf_fragmentation() {
 
 double sf_utilization() {
     //printf("DEBUG UTIL: INSIDE UTIL\n");
+    size_t total_heap_size = arena_peak_heap_size();
     if (total_heap_size == 0) {
         printf("INSIDE TOTAL HEAP SIZE == 0\n");
         return 0.0;
@@ -742,19 +1409,52 @@ double sf_utilization() {
 }
 
 
-sf_block *coalesce_free_block(sf_block *block) {
+void sf_get_stats(sf_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    // Every field is a uint64_t, so the arenas' copies are summed word by word
+    uint64_t *total = (uint64_t *)stats;
+    uint64_t largest_free = 0;
+    for (int i = 0; arena_at(i) != NULL; i++) {
+        uint64_t *counters = (uint64_t *)&arena_at(i)->stats;
+        for (size_t j = 0; j < sizeof(sf_stats) / sizeof(uint64_t); j++) {
+            total[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+        }
+
+        // Except the largest free block, which is the largest of any arena's
+        uint64_t largest = __atomic_load_n(&arena_at(i)->stats.largest_free, __ATOMIC_RELAXED);
+        if (largest > largest_free) {
+            largest_free = largest;
+        }
+    }
+    stats->largest_free = largest_free;
+}
+
+
+double sf_external_fragmentation() {
+    sf_stats stats;
+    sf_get_stats(&stats);
+
+    uint64_t free_bytes = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        free_bytes += stats.free_bytes[i];
+    }
+    if (free_bytes == 0 || stats.largest_free > free_bytes) {
+        return 0.0;
+    }
+    return 1.0 - (double)stats.largest_free / free_bytes;
+}
+
+
+sf_block *coalesce_free_block(sf_arena *arena, sf_block *block) {
     size_t size = get_block_size(block);
 
-    // Check previous block
-    sf_footer *prev_footer = (sf_footer *)((char *)block - sizeof(sf_footer));
-    bool prev_free = false;
+    // Check previous block; only a free one has a footer to find it by
+    bool prev_free = ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) == 0;
     sf_block *prev_block = NULL;
 
-    if ((void *)prev_footer >= sf_mem_start()) {
-        uint64_t footer_val = *prev_footer ^ MAGIC;
-        size_t prev_size = footer_val & ~0xF;
-        prev_block = (sf_block *)((char *)block - prev_size);
-        prev_free = ((footer_val & THIS_BLOCK_ALLOCATED) == 0);
+    if (prev_free) {
+        prev_block = (sf_block *)((char *)block - prev_free_size(block));
     }
 
     // Check next block
@@ -764,14 +1464,15 @@ sf_block *coalesce_free_block(sf_block *block) {
 
     if ((char *)next_block < (char *)sf_mem_end()) {
         uint64_t next_header_val = next_block->header ^ MAGIC;
-        next_size = next_header_val & ~0xF;
+        next_size = (uint32_t)next_header_val & ~0xF;
         next_free = ((next_header_val & THIS_BLOCK_ALLOCATED) == 0);
     }
 
     // Coalescing cases
     if (prev_free && next_free) {
-        remove_free_block(prev_block);
-        remove_free_block(next_block);
+        stat_add(&arena->stats.coalesce_both, 1);
+        remove_free_block(arena, prev_block);
+        remove_free_block(arena, next_block);
 
         size_t combined_size = get_block_size(prev_block) + size + next_size;
         uint64_t new_header = ((uint64_t)0 << 32) | (combined_size & ~0xF);
@@ -780,11 +1481,12 @@ sf_block *coalesce_free_block(sf_block *block) {
         sf_footer *new_footer = (sf_footer *)((char *)prev_block + combined_size - sizeof(sf_footer));
         *new_footer = new_header ^ MAGIC;
 
-        insert_free_block(prev_block);
+        insert_free_block(arena, prev_block);
         return prev_block;
 
     } else if (prev_free) {
-        remove_free_block(prev_block);
+        stat_add(&arena->stats.coalesce_prev, 1);
+        remove_free_block(arena, prev_block);
 
         size_t combined_size = get_block_size(prev_block) + size;
         uint64_t new_header = ((uint64_t)0 << 32) | (combined_size & ~0xF);
@@ -793,11 +1495,12 @@ sf_block *coalesce_free_block(sf_block *block) {
         sf_footer *new_footer = (sf_footer *)((char *)prev_block + combined_size - sizeof(sf_footer));
         *new_footer = new_header ^ MAGIC;
 
-        insert_free_block(prev_block);
+        insert_free_block(arena, prev_block);
         return prev_block;
 
     } else if (next_free) {
-        remove_free_block(next_block);
+        stat_add(&arena->stats.coalesce_next, 1);
+        remove_free_block(arena, next_block);
 
         size_t combined_size = size + next_size;
         uint64_t new_header = ((uint64_t)0 << 32) | (combined_size & ~0xF);
@@ -806,18 +1509,67 @@ sf_block *coalesce_free_block(sf_block *block) {
         sf_footer *new_footer = (sf_footer *)((char *)block + combined_size - sizeof(sf_footer));
         *new_footer = new_header ^ MAGIC;
 
-        insert_free_block(block);
+        insert_free_block(arena, block);
         return block;
 
     } else {
+        stat_add(&arena->stats.coalesce_none, 1);
         uint64_t new_header = ((uint64_t)0 << 32) | (size & ~0xF);
         block->header = new_header ^ MAGIC;
 
         sf_footer *footer = (sf_footer *)((char *)block + size - sizeof(sf_footer));
         *footer = new_header ^ MAGIC;
 
-        insert_free_block(block);
+        insert_free_block(arena, block);
         return block;
     }
 }
 
+
+int sf_mallopt(int param, int value) {
+    switch (param) {
+        case SF_OPT_TCACHE_COUNT:
+            if (value < 0) {
+                return 0;
+            }
+            __atomic_store_n(&tcache_count, value, __ATOMIC_RELAXED);
+            return 1;
+        case SF_OPT_ARENA_COUNT:
+            return arena_set_count(value);
+        case SF_OPT_ARENA_POLICY:
+            return arena_set_policy(value);
+        case SF_OPT_TREE_THRESHOLD:
+            return tree_set_threshold(value);
+        case SF_OPT_GROW_CHUNK:
+            if (value < 0) {
+                return 0;
+            }
+            grow_chunk = value < PAGE_SZ ? PAGE_SZ : ((size_t)value + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ;
+            return 1;
+        case SF_OPT_MMAP_THRESHOLD:
+            if (value < 0) {
+                return 0;
+            }
+            mmap_threshold = value;
+            return 1;
+        case SF_OPT_TRIM_THRESHOLD:
+            if (value < 0) {
+                return 0;
+            }
+            trim_threshold = value;
+            return 1;
+        case SF_OPT_SLAB:
+            slab_enabled = value != 0;
+            return 1;
+        case SF_OPT_DEFER_COALESCE:
+            return defer_set_threshold(value);
+        case SF_OPT_QUICK_LIST_MAX:
+            if (value < QUICK_LIST_MAX) {
+                return 0;
+            }
+            quick_list_max = value;
+            return 1;
+        default:
+            return 0;
+    }
+}
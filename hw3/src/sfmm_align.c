@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Aligned allocation.
+ *
+ * A free block with room for the request plus the alignment is found as usual.  The
+ * gap in front of the first suitably aligned payload is split off as a free block of
+ * its own, and the rest is split like any other allocation, so the result is an
+ * ordinary block as far as sf_free() and sf_realloc() are concerned:
+ *
+ *     +--------------+--------+------------------------+--------------- - -
+ *     | allocated    | gap    | header | payload        | leftover
+ *     |              | (free) |        | (aligned)      | (free)
+ *     +--------------+--------+------------------------+--------------- - -
+ *
+ * Requests that, with the alignment added, would get a mapping of their own get an
+ * aligned one instead (see mmap_memalign()).
+ */
+
+/**
+ * @return The gap to leave in front of a block at block so that its payload is aligned,
+ * which is either none or big enough to be a free block itself.
+ */
+static size_t align_gap(sf_block *block, size_t align) {
+    uintptr_t payload = (uintptr_t)block + sizeof(sf_header);
+    size_t gap = (align - payload % align) % align;
+    if (gap != 0 && gap < MIN_BLOCK_SIZE) {
+        gap += align;
+    }
+    return gap;
+}
+
+/**
+ * Allocates an aligned payload of size bytes from the arena.  Caller holds arena->lock.
+ */
+static void *align_malloc_locked(sf_arena *arena, size_t align, size_t size) {
+    size_t aligned_size = block_size_for(size);
+    size_t wanted = aligned_size + align + MIN_BLOCK_SIZE;
+
+    arena_drain_remote(arena);
+
+    sf_block *block = find_free_block(arena, wanted);
+    if (block == NULL && defer_consolidate(arena)) {
+        block = find_free_block(arena, wanted);
+    }
+    while (block == NULL) {
+        if (!grow_arena(arena, wanted)) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        block = find_free_block(arena, wanted);
+    }
+
+    size_t gap = align_gap(block, align);
+    if (gap != 0) {
+        uint64_t header = block->header ^ MAGIC;
+        size_t block_size = (uint32_t)header & ~0xF;
+        uint64_t zeroed = header & KNOWN_ZERO;
+        remove_free_block(arena, block);
+
+        // The rest goes in first, so that inserting the gap clears its PREV_BLOCK_ALLOCATED
+        sf_block *rest = (sf_block *)((char *)block + gap);
+        set_free_header(rest, (block_size - gap) | zeroed);
+        insert_free_block(arena, rest);
+        set_free_header(block, gap | PREV_BLOCK_ALLOCATED | zeroed);
+        insert_free_block(arena, block);
+        block = rest;
+    }
+
+    split_block(arena, block, aligned_size, size);
+    return (char *)block + sizeof(sf_header);
+}
+
+void *sf_aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if (align <= 16) {
+        return sf_malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > MAX_HEAP_REQUEST || align > MAX_HEAP_REQUEST - size) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    if (mmap_wanted(size + align)) {
+        return mmap_memalign(align, size);
+    }
+
+    sf_arena *arena = thread_arena();
+    arena_lock(arena);
+    void *ptr = align_malloc_locked(arena, align, size);
+    arena_unlock(arena);
+    return ptr;
+}
+
+int sf_posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0 || align == 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void *ptr = sf_aligned_alloc(align, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
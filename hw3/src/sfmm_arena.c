@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Arenas and the threads assigned to them.
+ *
+ * Each thread is bound to one arena on its first allocator call and keeps it until it
+ * exits.  Blocks always go back to the arena whose segment they live in, which is
+ * found through a table of segment start addresses.  Segments are only ever appended
+ * as the heap grows, so the table stays sorted and can be searched without a lock.
+ */
+
+typedef struct {
+    char *start;        // First byte of the segment (a page returned by sf_mem_grow()).
+    sf_arena *arena;    // Arena that owns every block in the segment.
+    bool slab;          // A single page holding a slab run (sfmm_slab.c).
+} sf_segment;
+
+static sf_arena arenas[SF_MAX_ARENAS];
+static int arena_count = 1;
+static int arena_policy = SF_ARENA_ROUND_ROBIN;
+static int next_arena = 0;
+static bool arenas_ready = false;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+static sf_segment segments[SF_MAX_SEGMENTS];
+static int segment_count = 0;
+static bool slab_segments = false;
+
+/* Serializes sf_mem_grow(), the segment table and the heap size. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t total_heap_size = 0;
+static size_t peak_heap_size = 0;
+
+static pthread_key_t thread_key;
+static int thread_count = 0;
+int sf_multithreaded = 0;
+
+static __thread sf_arena *current_arena;
+
+static void thread_detach(void *arg);
+
+static void arenas_setup(void) {
+    for (int i = 0; i < SF_MAX_ARENAS; i++) {
+        sf_arena *arena = &arenas[i];
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->free_list_heads = arena->own_free_list_heads;
+        arena->quick_lists = arena->own_quick_lists;
+    }
+    arenas[0].free_list_heads = sf_free_list_heads;
+    arenas[0].quick_lists = sf_quick_lists;
+
+    pthread_key_create(&thread_key, thread_detach);
+    __atomic_store_n(&arenas_ready, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Picks an arena for a thread that has not used the allocator before.
+ */
+static sf_arena *choose_arena(void) {
+    if (arena_count == 1) {
+        return &arenas[0];
+    }
+
+    if (arena_policy == SF_ARENA_LEAST_LOADED) {
+        sf_arena *best = &arenas[0];
+        for (int i = 1; i < arena_count; i++) {
+            if (__atomic_load_n(&arenas[i].threads, __ATOMIC_RELAXED) <
+                __atomic_load_n(&best->threads, __ATOMIC_RELAXED)) {
+                best = &arenas[i];
+            }
+        }
+        return best;
+    }
+
+    return &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % arena_count];
+}
+
+/**
+ * Binds the calling thread to an arena and arranges for thread_detach() to run when
+ * it exits.  The per-thread caches switch on once two threads are attached.
+ */
+static sf_arena *thread_attach(void) {
+    pthread_once(&arenas_once, arenas_setup);
+
+    sf_arena *arena = choose_arena();
+    __atomic_add_fetch(&arena->threads, 1, __ATOMIC_RELAXED);
+    current_arena = arena;
+    pthread_setspecific(thread_key, arena);
+
+    if (__atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED) > 1) {
+        __atomic_store_n(&sf_multithreaded, 1, __ATOMIC_RELEASE);
+    }
+    return arena;
+}
+
+/**
+ * Thread exit: hand the thread's cached blocks back and release its arena.  The last
+ * thread to leave an arena also frees whatever other threads queued for it.
+ */
+static void thread_detach(void *arg) {
+    sf_arena *arena = arg;
+
+    slab_release(arena);
+    tcache_release(arena);
+
+    if (__atomic_sub_fetch(&arena->threads, 1, __ATOMIC_SEQ_CST) == 0) {
+        arena_lock(arena);
+        arena_drain_remote(arena);
+        arena_unlock(arena);
+    }
+    __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return The arena the calling thread allocates from.
+ */
+sf_arena *thread_arena(void) {
+    if (current_arena != NULL) {
+        return current_arena;
+    }
+    return thread_attach();
+}
+
+/**
+ * @return The segment containing ptr, which must lie inside the heap.
+ */
+static sf_segment *segment_of(void *ptr) {
+    // Last segment starting at or below ptr
+    int lo = 0;
+    int hi = __atomic_load_n(&segment_count, __ATOMIC_ACQUIRE) - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (segments[mid].start <= (char *)ptr) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &segments[lo];
+}
+
+/**
+ * @return The arena that owns the block containing ptr.
+ */
+sf_arena *arena_of(void *ptr) {
+    if (arena_count == 1) {
+        return &arenas[0];
+    }
+    return segment_of(ptr)->arena;
+}
+
+/**
+ * @return true if ptr lies in a slab run page.
+ */
+bool arena_is_slab(void *ptr) {
+    if (!__atomic_load_n(&slab_segments, __ATOMIC_ACQUIRE) ||
+        (char *)ptr < (char *)sf_mem_start() || (char *)ptr >= (char *)sf_mem_end()) {
+        return false;
+    }
+    return segment_of(ptr)->slab;
+}
+
+/**
+ * Queues a block for the arena that owns it, without taking that arena's lock.
+ *
+ * @return false if no thread is left to drain the queue, in which case the caller
+ * should free the block under the arena lock itself.
+ */
+bool arena_remote_free(sf_arena *arena, sf_block *block) {
+    if (__atomic_load_n(&arena->threads, __ATOMIC_SEQ_CST) == 0) {
+        return false;
+    }
+
+    sf_block *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        block->body.links.next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, block, true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    // The arena's last thread may have left between the check above and the push
+    if (__atomic_load_n(&arena->threads, __ATOMIC_SEQ_CST) == 0) {
+        arena_lock(arena);
+        arena_drain_remote(arena);
+        arena_unlock(arena);
+    }
+    return true;
+}
+
+/**
+ * Frees every block other threads have queued for this arena.  Caller holds arena->lock.
+ */
+void arena_drain_remote(sf_arena *arena) {
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    sf_block *block = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_SEQ_CST);
+    while (block != NULL) {
+        sf_block *next = block->body.links.next;
+        free_locked(arena, (char *)block + sizeof(sf_header));
+        block = next;
+    }
+}
+
+/**
+ * Locks an arena, setting up its lists the first time it is used.
+ */
+void arena_lock(sf_arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    if (!arena->initialized) {
+        sf_init(arena);
+        arena->initialized = true;
+    }
+}
+
+void arena_unlock(sf_arena *arena) {
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Locks every arena in index order, for whole-heap walks.
+ */
+void arena_lock_all(void) {
+    pthread_once(&arenas_once, arenas_setup);
+    for (int i = 0; i < arena_count; i++) {
+        arena_lock(&arenas[i]);
+    }
+}
+
+void arena_unlock_all(void) {
+    for (int i = arena_count - 1; i >= 0; i--) {
+        arena_unlock(&arenas[i]);
+    }
+}
+
+/**
+ * Adds size bytes to the heap size and raises its peak, which trimming never lowers.
+ */
+static void heap_size_add(size_t size) {
+    size_t current = __atomic_add_fetch(&total_heap_size, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_heap_size, __ATOMIC_RELAXED);
+
+    // Reclaimed pages are counted under arena locks rather than heap_lock
+    while (current > peak &&
+           !__atomic_compare_exchange_n(&peak_heap_size, &peak, current, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Takes pages from sf_mem_grow() on behalf of an arena.  Caller holds arena->lock.
+ * The pages are taken back to back under the heap lock, so they are contiguous.
+ *
+ * @param size On entry the number of bytes wanted, a multiple of PAGE_SZ; on return the
+ * number obtained, which is less if the heap ran out part way.
+ * @param in_place Set to true if the pages directly follow the arena's last segment,
+ * false if they have been registered as the start of a new segment.
+ *
+ * @return The start of the first new page, or NULL if the heap cannot grow at all.
+ */
+void *arena_mem_grow(sf_arena *arena, size_t *size, bool *in_place) {
+    pthread_mutex_lock(&heap_lock);
+
+    *in_place = arena->heap_end != NULL && arena->heap_end == (char *)sf_mem_end();
+    if (!*in_place && segment_count == SF_MAX_SEGMENTS) {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+
+    char *start = sf_mem_grow();
+    stat_add(&arena->stats.mem_grows, 1);
+    if (start == NULL) {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+
+    size_t grown = PAGE_SZ;
+    while (grown < *size) {
+        stat_add(&arena->stats.mem_grows, 1);
+        if (sf_mem_grow() == NULL) {
+            break;
+        }
+        grown += PAGE_SZ;
+    }
+    *size = grown;
+
+    if (!*in_place) {
+        segments[segment_count].start = start;
+        segments[segment_count].arena = arena;
+        segments[segment_count].slab = false;
+        __atomic_store_n(&segment_count, segment_count + 1, __ATOMIC_RELEASE);
+    }
+
+    arena->heap_end = start + grown;
+    heap_size_add(grown);
+
+    pthread_mutex_unlock(&heap_lock);
+    return start;
+}
+
+/**
+ * Takes one page from sf_mem_grow() for a slab run and registers it as a segment of
+ * its own.  The arena's last ordinary segment can no longer grow in place afterwards.
+ * Caller holds arena->lock.
+ *
+ * @return The page, or NULL if the heap cannot grow.
+ */
+void *arena_slab_page(sf_arena *arena) {
+    pthread_mutex_lock(&heap_lock);
+
+    char *page = NULL;
+    if (segment_count < SF_MAX_SEGMENTS) {
+        page = sf_mem_grow();
+        stat_add(&arena->stats.mem_grows, 1);
+    }
+    if (page != NULL) {
+        segments[segment_count].start = page;
+        segments[segment_count].arena = arena;
+        segments[segment_count].slab = true;
+        __atomic_store_n(&segment_count, segment_count + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&slab_segments, true, __ATOMIC_RELEASE);
+        heap_size_add(PAGE_SZ);
+    }
+
+    pthread_mutex_unlock(&heap_lock);
+    return page;
+}
+
+/**
+ * Turns a slab run page back into an ordinary segment.  Caller holds arena->lock.
+ */
+void arena_slab_unmark(void *page) {
+    __atomic_store_n(&segment_of(page)->slab, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return The number of bytes obtained from sf_mem_grow(), less any released by trimming.
+ */
+size_t arena_heap_size(void) {
+    return __atomic_load_n(&total_heap_size, __ATOMIC_RELAXED);
+}
+
+void arena_heap_release(size_t size) {
+    __atomic_sub_fetch(&total_heap_size, size, __ATOMIC_RELAXED);
+}
+
+void arena_heap_reclaim(size_t size) {
+    heap_size_add(size);
+}
+
+/**
+ * @return The largest arena_heap_size() has been, the denominator of sf_utilization().
+ * Peak payload is measured against the peak heap, since released pages may have held
+ * some of it when it peaked.
+ */
+size_t arena_peak_heap_size(void) {
+    return __atomic_load_n(&peak_heap_size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return Arena number index, or NULL if there are not that many arenas.
+ */
+sf_arena *arena_at(int index) {
+    return index < arena_count ? &arenas[index] : NULL;
+}
+
+/**
+ * Sets the number of arenas.  Only possible before the first allocation.
+ */
+int arena_set_count(int count) {
+    if (count < 1 || count > SF_MAX_ARENAS || __atomic_load_n(&arenas_ready, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    arena_count = count;
+    return 1;
+}
+
+int arena_set_policy(int policy) {
+    if (policy != SF_ARENA_ROUND_ROBIN && policy != SF_ARENA_LEAST_LOADED) {
+        return 0;
+    }
+    arena_policy = policy;
+    return 1;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Batch allocation and release.
+ *
+ * sf_malloc_batch() takes its arena's lock once and cuts as many blocks as it can from
+ * each free block it finds, in a single pass, rather than searching and splitting once
+ * per block.  sf_free_batch() sorts the pointers by address, so a run of neighbouring
+ * blocks is merged into one free block and coalesced once, rather than once per block.
+ */
+
+static inline size_t batch_block_size(sf_block *block) {
+    return ((uint32_t)(block->header ^ MAGIC)) & ~0xF;
+}
+
+/**
+ * Cuts up to n allocated blocks of block_size, for payloads of size bytes, from the
+ * front of a free block and stores their payload pointers in out.  The last block
+ * absorbs a remainder too small to stand alone.  Caller holds arena->lock.
+ *
+ * @return The number of blocks cut.
+ */
+static size_t batch_carve(sf_arena *arena, sf_block *block, size_t block_size, size_t size,
+                          size_t n, void **out) {
+    size_t free_size = batch_block_size(block);
+    size_t count = free_size / block_size;
+    if (count > n) {
+        count = n;
+    }
+    size_t leftover = free_size - count * block_size;
+    uint64_t prev_allocated = (block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED;
+    uint64_t zeroed = (block->header ^ MAGIC) & KNOWN_ZERO;
+
+    remove_free_block(arena, block);
+    stat_add(&arena->stats.free_list_hits[get_free_list_index(free_size)], 1);
+    if (leftover != 0) {
+        stat_add(leftover >= MIN_BLOCK_SIZE ? &arena->stats.splits : &arena->stats.splinters_avoided, 1);
+    }
+
+    char *curr = (char *)block;
+    for (size_t i = 0; i < count; i++) {
+        size_t this_size = block_size;
+        if (i == count - 1 && leftover < MIN_BLOCK_SIZE) {
+            this_size += leftover;
+        }
+        stat_live(arena, this_size, 1);
+        stat_add(&arena->allocated_bytes, this_size);
+        set_allocated_header((sf_block *)curr, ((uint64_t)size << 32) | this_size | THIS_BLOCK_ALLOCATED | prev_allocated);
+        prev_allocated = PREV_BLOCK_ALLOCATED;
+        out[i] = curr + sizeof(sf_header);
+        curr += this_size;
+    }
+
+    if (leftover >= MIN_BLOCK_SIZE) {
+        sf_block *rest = (sf_block *)curr;
+        rest->header = ((uint64_t)leftover | PREV_BLOCK_ALLOCATED | zeroed) ^ MAGIC;
+        insert_free_block(arena, rest);
+    } else {
+        set_prev_allocated((sf_block *)curr, true);
+    }
+
+    adjust_payload(size * count);
+    return count;
+}
+
+size_t sf_malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+
+    // Mapped and slab requests do not come from free blocks
+    if (mmap_wanted(size) || (slab_enabled && size <= SLAB_MAX_SIZE)) {
+        size_t count = 0;
+        while (count < n && (out[count] = sf_malloc(size)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+    if (size > MAX_HEAP_REQUEST) {
+        sf_errno = ENOMEM;
+        return 0;
+    }
+
+    size_t block_size = block_size_for(size);
+    sf_arena *arena = thread_arena();
+    arena_lock(arena);
+
+    // Cached blocks of the right size go first, as they would for single requests
+    size_t count = 0;
+    if (block_size <= QUICK_LIST_LIMIT) {
+        while (count < n && arena->quick_lists[QUICK_LIST_INDEX(block_size)].first != NULL) {
+            out[count++] = malloc_locked(arena, size, NULL);
+        }
+    }
+
+    arena_drain_remote(arena);
+
+    while (count < n) {
+        size_t want = n - count;
+        if (want > UINT32_MAX / block_size) {
+            want = UINT32_MAX / block_size;
+        }
+
+        // Ideally one free block holds the lot; otherwise take whatever one block holds
+        sf_block *block = find_free_block(arena, block_size * want);
+        if (block == NULL) {
+            block = find_free_block(arena, block_size);
+        }
+        if (block != NULL) {
+            count += batch_carve(arena, block, block_size, size, want, out + count);
+            continue;
+        }
+
+        if (!defer_consolidate(arena) && !grow_arena(arena, block_size * want) &&
+            !grow_arena(arena, block_size)) {
+            sf_errno = ENOMEM;
+            break;
+        }
+    }
+
+    arena_unlock(arena);
+    return count;
+}
+
+static int batch_compare(const void *a, const void *b) {
+    char *x = *(char * const *)a;
+    char *y = *(char * const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Moves the batch's lock from *held to arena, which may be NULL to just let go.
+ */
+static void batch_lock(sf_arena **held, sf_arena *arena) {
+    if (*held == arena) {
+        return;
+    }
+    if (*held != NULL) {
+        trim_tail(*held);
+        arena_unlock(*held);
+    }
+    if (arena != NULL) {
+        arena_lock(arena);
+    }
+    *held = arena;
+}
+
+void sf_free_batch(void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(void *), batch_compare);
+
+    sf_arena *arena = NULL;
+    size_t i = 0;
+    while (i < n) {
+        char *ptr = ptrs[i++];
+        if (ptr == NULL) {
+            continue;
+        }
+
+        sf_block *block = (sf_block *)(ptr - sizeof(sf_header));
+        if (slab_size(ptr) != 0 || ((block->header ^ MAGIC) & MMAPPED)) {
+            batch_lock(&arena, NULL);
+            sf_free(ptr);
+            continue;
+        }
+
+        batch_lock(&arena, arena_of(ptr));
+
+        // Blocks that follow on directly are merged before the free lists see them
+        size_t size = batch_block_size(block);
+        size_t payload = (block->header ^ MAGIC) >> 32;
+        size_t run = 1;
+        while (i < n && (char *)ptrs[i] == ptr + size) {
+            sf_block *next = (sf_block *)((char *)block + size);
+            payload += (next->header ^ MAGIC) >> 32;
+            stat_live(arena, batch_block_size(next), -1);
+            size += batch_block_size(next);
+            i++;
+            run++;
+        }
+
+        if (run == 1) {
+            free_locked(arena, ptr);
+            continue;
+        }
+
+        stat_live(arena, batch_block_size(block), -1);
+
+        adjust_payload(-payload);
+        stat_add(&arena->allocated_bytes, -size);
+        set_free_header(block, size | ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED));
+        coalesce_free_block(arena, block);
+    }
+
+    batch_lock(&arena, NULL);
+}
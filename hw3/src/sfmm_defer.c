@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Deferred coalescing.
+ *
+ * With a defer threshold set, sf_free() does not merge a block too big for the quick
+ * lists with its neighbours straight away.  The block goes onto its arena's unsorted
+ * bin instead, marked like a quick-list block so that the rest of the heap still sees
+ * it as allocated.  A later request that fits it without leaving a splinter takes it
+ * back as it is, with no list or split work.  Everything in the bin is consolidated in
+ * one pass when a request finds nothing in the free lists, or once the bin holds more
+ * than defer_threshold bytes.  The pass goes in address order, so a run of neighbouring
+ * blocks is merged into one before it touches the free lists.
+ */
+
+size_t defer_threshold = 0;
+
+static inline size_t defer_size(sf_block *block) {
+    return ((uint32_t)(block->header ^ MAGIC)) & ~0xF;
+}
+
+/**
+ * Puts a freed block on the unsorted bin, consolidating the bin if it has grown past
+ * defer_threshold.  Caller holds arena->lock.
+ */
+void defer_free(sf_arena *arena, sf_block *block) {
+    size_t size = defer_size(block);
+    uint64_t prev_allocated = (block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED;
+    set_allocated_header(block, size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST | prev_allocated);
+
+    block->body.links.next = arena->unsorted;
+    arena->unsorted = block;
+    arena->unsorted_size += size;
+
+    if (arena->unsorted_size > defer_threshold) {
+        defer_consolidate(arena);
+    }
+}
+
+/**
+ * Takes a block of at least size bytes off the unsorted bin, if one fits without
+ * leaving a splinter.  The block keeps its header; the caller allocates it in full.
+ * Caller holds arena->lock.
+ *
+ * @return The block, or NULL if none fits.
+ */
+sf_block *defer_take(sf_arena *arena, size_t size) {
+    sf_block **link = &arena->unsorted;
+    while (*link != NULL) {
+        sf_block *block = *link;
+        size_t block_size = defer_size(block);
+        if (block_size >= size && block_size - size < MIN_BLOCK_SIZE) {
+            *link = block->body.links.next;
+            arena->unsorted_size -= block_size;
+            return block;
+        }
+        link = &block->body.links.next;
+    }
+    return NULL;
+}
+
+/**
+ * Coalesces every block on the unsorted bin into the free lists.  Caller holds
+ * arena->lock.
+ *
+ * @return true if the bin was not empty.
+ */
+bool defer_consolidate(sf_arena *arena) {
+    sf_block *list = sort_blocks_by_address(arena->unsorted);
+    if (list == NULL) {
+        return false;
+    }
+    arena->unsorted = NULL;
+    arena->unsorted_size = 0;
+
+    while (list != NULL) {
+        sf_block *block = list;
+        size_t size = defer_size(block);
+        list = block->body.links.next;
+
+        // Blocks that follow on directly are merged before the free lists see them
+        while (list != NULL && (char *)list == (char *)block + size) {
+            size += defer_size(list);
+            list = list->body.links.next;
+        }
+
+        stat_add(&arena->allocated_bytes, -size);
+        set_free_header(block, size | ((block->header ^ MAGIC) & PREV_BLOCK_ALLOCATED));
+        coalesce_free_block(arena, block);
+    }
+    return true;
+}
+
+/**
+ * Sets defer_threshold.  Turning deferral off flushes every arena's unsorted bin.
+ *
+ * @return 1 if the threshold was changed, 0 if it is negative.
+ */
+int defer_set_threshold(int threshold) {
+    if (threshold < 0) {
+        return 0;
+    }
+
+    if (threshold != 0) {
+        __atomic_store_n(&defer_threshold, threshold, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    arena_lock_all();
+    defer_threshold = 0;
+    sf_arena *arena;
+    for (int i = 0; (arena = arena_at(i)) != NULL; i++) {
+        defer_consolidate(arena);
+    }
+    arena_unlock_all();
+    return 1;
+}
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Huge allocations.
+ *
+ * A request whose block would be larger than mmap_threshold gets an anonymous mapping
+ * of its own instead of a block in the heap, so that freeing it hands the memory
+ * straight back to the system.  The mapping starts with its length, followed by an
+ * ordinary allocated block header with the MMAPPED bit set and no block size:
+ *
+ *     +--------------+--------------+------------------------------ - -
+ *     | length       | header       | payload (16-byte aligned)
+ *     +--------------+--------------+------------------------------ - -
+ *
+ * An aligned mapping (see mmap_memalign()) may start up to a page before the length,
+ * which counts from the start of that page.
+ *
+ * Mapped blocks have no footer and never take part in coalescing, and their payload
+ * is not counted towards sf_utilization(), which is relative to the heap.
+ */
+
+size_t mmap_threshold = 0;
+
+static inline size_t *mmap_start(sf_block *block) {
+    return (size_t *)((char *)block - sizeof(size_t));
+}
+
+/* The start of the mapping: the page holding the length. */
+static inline char *mmap_base(size_t *start) {
+    return (char *)((uintptr_t)start & ~(PAGE_SZ - 1));
+}
+
+static inline size_t mmap_length(size_t size) {
+    return (sizeof(size_t) + sizeof(sf_header) + size + PAGE_SZ - 1) / PAGE_SZ * PAGE_SZ;
+}
+
+static inline void mmap_set_header(sf_block *block, size_t size) {
+    uint64_t header = ((uint64_t)size << 32) | MMAPPED | THIS_BLOCK_ALLOCATED;
+    block->header = header ^ MAGIC;
+}
+
+/**
+ * @return A payload of size bytes in a mapping of its own, or NULL with sf_errno set.
+ */
+void *mmap_malloc(size_t size) {
+    if (size > UINT32_MAX) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t length = mmap_length(size);
+    size_t *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    *start = length;
+    sf_block *block = (sf_block *)(start + 1);
+    mmap_set_header(block, size);
+    return (char *)block + sizeof(sf_header);
+}
+
+/**
+ * @return A payload of size bytes aligned to align (a power of two) in a mapping of its
+ * own, or NULL with sf_errno set.
+ */
+void *mmap_memalign(size_t align, size_t size) {
+    size_t length = mmap_length(size + align);
+    char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    // Map an alignment's worth too much, then unmap the whole pages either side
+    uintptr_t payload = ((uintptr_t)map + sizeof(size_t) + sizeof(sf_header) + align - 1) & ~(align - 1);
+    size_t *start = (size_t *)(payload - sizeof(sf_header) - sizeof(size_t));
+    char *base = mmap_base(start);
+    char *end = (char *)((payload + size + PAGE_SZ - 1) & ~(PAGE_SZ - 1));
+    if (base > map) {
+        munmap(map, base - map);
+    }
+    if (end < map + length) {
+        munmap(end, map + length - end);
+    }
+
+    *start = end - base;
+    sf_block *block = (sf_block *)(start + 1);
+    mmap_set_header(block, size);
+    return (void *)payload;
+}
+
+/**
+ * @return The bytes from a mapped block's payload to the end of its mapping.
+ */
+size_t mmap_usable_size(sf_block *block) {
+    size_t *start = mmap_start(block);
+    return mmap_base(start) + *start - ((char *)block + sizeof(sf_header));
+}
+
+void mmap_free(sf_block *block) {
+    size_t *start = mmap_start(block);
+    munmap(mmap_base(start), *start);
+}
+
+/**
+ * Resizes a mapped block.  Sizes that still warrant a mapping are handled by mremap(),
+ * which moves the pages rather than copying them; smaller ones move back into the heap.
+ *
+ * @return The new payload pointer, or NULL with sf_errno set and the block untouched.
+ */
+void *mmap_realloc(sf_block *block, size_t rsize) {
+    size_t *start = mmap_start(block);
+    size_t old_size = mmap_usable_size(block);
+
+    if (!mmap_wanted(rsize)) {
+        void *ptr = sf_malloc(rsize);
+        if (ptr == NULL) {
+            return NULL;
+        }
+        memcpy(ptr, (char *)block + sizeof(sf_header), rsize < old_size ? rsize : old_size);
+        mmap_free(block);
+        return ptr;
+    }
+
+    if (rsize > UINT32_MAX) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    char *base = mmap_base(start);
+    size_t offset = (char *)start - base;
+    size_t length = mmap_length(offset + rsize);
+    if (length != *start) {
+        base = mremap(base, *start, length, MREMAP_MAYMOVE);
+        if (base == MAP_FAILED) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        start = (size_t *)(base + offset);
+        *start = length;
+        block = (sf_block *)(start + 1);
+    }
+
+    mmap_set_header(block, rsize);
+    return (char *)block + sizeof(sf_header);
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Latency histograms.
+ *
+ * Built with -DPROFILE_LATENCY, sf_malloc(), sf_free() and sf_realloc() time themselves
+ * and count the result in the histogram of the path the call took, which the code along
+ * the way reports with prof_path().  The last path reported wins, so a caller that
+ * delegates to another entry point reports its own path afterwards.  Only the outermost
+ * call is timed: sf_realloc()'s own sf_malloc() and sf_free() are part of its time.
+ *
+ * Times are TSC cycles on x86 and nanoseconds elsewhere.  Each histogram has four
+ * buckets per power of two, so a percentile is read off to within a quarter of its
+ * value.  Counts are shared by all threads and added atomically.
+ */
+
+/* Buckets 0..7 hold exact times; from 8 on, four per power of two up to 2^64. */
+#define PROF_BUCKETS 252
+
+#ifdef PROFILE_LATENCY
+
+static const char *path_names[SF_PATH_COUNT] = {
+    [SF_PATH_MALLOC_TCACHE]  = "malloc tcache",
+    [SF_PATH_MALLOC_SLAB]    = "malloc slab",
+    [SF_PATH_MALLOC_QUICK]   = "malloc quick list",
+    [SF_PATH_MALLOC_FIT]     = "malloc free list",
+    [SF_PATH_MALLOC_SPLIT]   = "malloc split",
+    [SF_PATH_MALLOC_GROW]    = "malloc grow",
+    [SF_PATH_MALLOC_MMAP]    = "malloc mmap",
+    [SF_PATH_FREE_TCACHE]    = "free tcache",
+    [SF_PATH_FREE_SLAB]      = "free slab",
+    [SF_PATH_FREE_QUICK]     = "free quick list",
+    [SF_PATH_FREE_FLUSH]     = "free flush",
+    [SF_PATH_FREE_REMOTE]    = "free remote",
+    [SF_PATH_FREE_DEFER]     = "free deferred",
+    [SF_PATH_FREE_ALONE]     = "free no coalesce",
+    [SF_PATH_FREE_PREV]      = "free coalesce prev",
+    [SF_PATH_FREE_NEXT]      = "free coalesce next",
+    [SF_PATH_FREE_BOTH]      = "free coalesce both",
+    [SF_PATH_FREE_MMAP]      = "free mmap",
+    [SF_PATH_REALLOC_SHRINK] = "realloc shrink",
+    [SF_PATH_REALLOC_EXTEND] = "realloc extend",
+    [SF_PATH_REALLOC_MOVE]   = "realloc move",
+    [SF_PATH_REALLOC_MMAP]   = "realloc mmap",
+};
+
+static uint64_t histograms[SF_PATH_COUNT][PROF_BUCKETS];
+
+static __thread int prof_depth = 0;
+static __thread int prof_current = -1;
+
+static inline uint64_t prof_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline int prof_bucket(uint64_t ticks) {
+    if (ticks < 8) {
+        return ticks;
+    }
+    int exponent = 63 - __builtin_clzll(ticks);
+    return 4 * (exponent - 1) + ((ticks >> (exponent - 2)) & 3);
+}
+
+uint64_t prof_begin(void) {
+    if (prof_depth++ > 0) {
+        return 0;
+    }
+    prof_current = -1;
+    return prof_now();
+}
+
+void prof_end(uint64_t start) {
+    if (--prof_depth > 0 || prof_current < 0) {
+        return;
+    }
+    uint64_t ticks = prof_now() - start;
+    __atomic_add_fetch(&histograms[prof_current][prof_bucket(ticks)], 1, __ATOMIC_RELAXED);
+}
+
+void prof_path(int path) {
+    prof_current = path;
+}
+
+/* The smallest time counted in a bucket, which is one past the largest of the one before. */
+static uint64_t bucket_floor(int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    int exponent = bucket / 4 + 1;
+    return (uint64_t)(4 + bucket % 4) << (exponent - 2);
+}
+
+#endif
+
+uint64_t sf_latency_count(int path) {
+    uint64_t count = 0;
+#ifdef PROFILE_LATENCY
+    if (path >= 0 && path < SF_PATH_COUNT) {
+        for (int i = 0; i < PROF_BUCKETS; i++) {
+            count += __atomic_load_n(&histograms[path][i], __ATOMIC_RELAXED);
+        }
+    }
+#endif
+    return count;
+}
+
+uint64_t sf_latency_percentile(int path, double fraction) {
+#ifdef PROFILE_LATENCY
+    uint64_t count = sf_latency_count(path);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(fraction * count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < PROF_BUCKETS; i++) {
+        seen += __atomic_load_n(&histograms[path][i], __ATOMIC_RELAXED);
+        if (seen > rank) {
+            return i == PROF_BUCKETS - 1 ? UINT64_MAX : bucket_floor(i + 1) - 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+void sf_latency_reset(void) {
+#ifdef PROFILE_LATENCY
+    for (int path = 0; path < SF_PATH_COUNT; path++) {
+        for (int i = 0; i < PROF_BUCKETS; i++) {
+            __atomic_store_n(&histograms[path][i], 0, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+}
+
+void sf_latency_dump(FILE *out) {
+#ifdef PROFILE_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    fprintf(out, "%-20s %12s %12s %12s %12s  (%s)\n", "path", "count", "p50", "p99", "p999", unit);
+    for (int path = 0; path < SF_PATH_COUNT; path++) {
+        uint64_t count = sf_latency_count(path);
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "%-20s %12lu %12lu %12lu %12lu\n", path_names[path], (unsigned long)count,
+                (unsigned long)sf_latency_percentile(path, 0.5),
+                (unsigned long)sf_latency_percentile(path, 0.99),
+                (unsigned long)sf_latency_percentile(path, 0.999));
+    }
+#else
+    fprintf(out, "Latency histograms need a build with -DPROFILE_LATENCY\n");
+#endif
+}
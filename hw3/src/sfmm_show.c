@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Heap printers for compact links.
+ *
+ * lib/sfutil.o's sf_show_block() and sf_show_free_list() read free-list links as
+ * pointers.  The build links a copy of sfutil.o in which those two are weak, so that
+ * with -DCOMPACT_LINKS the versions here replace them, in the calls sf_show_free_lists()
+ * and sf_show_heap() make as well.  They print the same lines, but decode the links
+ * with free_list_next() and free_list_prev(), and skip the footer check for a minimal
+ * block, which has no room for a footer.
+ */
+
+#ifdef COMPACT_LINKS
+
+extern int sf_util_quiet;
+
+void sf_show_block(sf_block *bp) {
+    if (sf_util_quiet) {
+        return;
+    }
+
+    uint64_t header = bp->header ^ MAGIC;
+    size_t size = (uint32_t)header & ~0xF;
+    unsigned allocated = (header & THIS_BLOCK_ALLOCATED) != 0;
+    fprintf(stderr, "%10p: ", bp);
+    fprintf(stderr, "[%-8s][sz: %8lu, al: %1u, ql: %u]", allocated ? "USED BLK" : "FREE BLK", size,
+            allocated, (header & IN_QUICK_LIST) != 0);
+
+    if (!allocated) {
+        sf_arena *arena = arena_of(bp);
+        fprintf(stderr, "[prev:%p, next:%p]", free_list_prev(arena, bp), free_list_next(arena, bp));
+
+        uint64_t footer = *(sf_footer *)((char *)bp + size - sizeof(sf_footer)) ^ MAGIC;
+        if (size > MIN_BLOCK_SIZE && footer != header) {
+            fprintf(stderr, "\n\t***FOOTER DOES NOT MATCH HEADER (0x%lx != 0x%lx)***", header, footer);
+        }
+    }
+    if (((uintptr_t)bp + sizeof(sf_header)) % 16 != 0) {
+        fprintf(stderr, "\n\t***PAYLOAD ADDRESS (%p) IS NOT ALIGNED***", (char *)bp + sizeof(sf_header));
+    }
+}
+
+void sf_show_free_list(int index) {
+    if (sf_util_quiet) {
+        return;
+    }
+
+    sf_block *head = &sf_free_list_heads[index];
+    fprintf(stderr, "[%10p]: ", head);
+
+    // The list heads are only set up by the first sf_malloc()
+    if (sf_mem_start() == sf_mem_end()) {
+        return;
+    }
+
+    sf_arena *arena = arena_at(0);
+    int limit = 100;
+    for (sf_block *bp = free_list_next(arena, head); bp != head; bp = free_list_next(arena, bp)) {
+        if (--limit < 0) {
+            fprintf(stderr, "Corrupted free list %d\n", index);
+            return;
+        }
+        fprintf(stderr, "\n    ");
+        sf_show_block(bp);
+    }
+}
+
+#endif
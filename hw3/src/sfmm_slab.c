@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Slabs for the smallest requests.
+ *
+ * With slabs enabled, a request of up to SLAB_MAX_SIZE bytes is rounded up to a
+ * multiple of 16 and served from a run: one heap page holding objects of a single
+ * size class, with no header or footer of their own.  The run's bookkeeping sits at
+ * the start of the page, so the run of an object is found by rounding its address down
+ * to the page, and its occupancy is one bit per object.  Each run page is registered as
+ * a segment of its own, which is how sf_free() tells slab objects from ordinary blocks.
+ *
+ * Runs with free objects hang off their arena's per-class list.  A run that empties out
+ * goes on the arena's list of empty runs, to be reused for any class, or to become an
+ * ordinary heap segment again once the heap is out of pages.  Each run also keeps the
+ * requested size of every object, ahead of the objects, so that the payload totals
+ * count what was asked for rather than the rounded object size.
+ *
+ * Once the per-thread caches are on, each thread keeps a bin of free objects per class
+ * in front of the runs, in the manner of the tcache bins: all from runs of the thread's
+ * own arena, taken half a bin at a time in one locked pass and given back the same way
+ * when the bin overflows.  Hits and frees into the bin take no lock.
+ */
+
+typedef struct sf_slab_run {
+    sf_arena *arena;            // Arena whose lock protects the run.
+    struct sf_slab_run *next;   // Neighbours on the per-class or empty run list.
+    struct sf_slab_run *prev;
+    uint32_t size;              // Object size.
+    uint16_t used;              // Objects currently allocated or in a thread's bin.
+    uint16_t capacity;          // Objects that fit in the page.
+    uint16_t objects;           // Offset of the first object in the page.
+    uint64_t bitmap[4];         // Bit set for every allocated object, and past capacity.
+    uint8_t requested[];        // Requested size of each object, 0 while it is not in use.
+} sf_slab_run;
+
+#define SLAB_OBJECTS(run) ((char *)(run) + (run)->objects)
+
+/* A thread's free objects of one class, linked through their first word. */
+typedef struct {
+    int length;
+    void *first;
+} sf_slab_bin;
+
+int slab_enabled = 0;
+
+static __thread sf_slab_bin slab_bins[NUM_SLAB_CLASSES];
+
+static inline sf_slab_run *slab_run_of(void *ptr) {
+    char *start = sf_mem_start();
+    return (sf_slab_run *)(start + (((char *)ptr - start) & ~(PAGE_SZ - 1)));
+}
+
+static void slab_unlink(sf_slab_run **list, sf_slab_run *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        *list = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+static void slab_push(sf_slab_run **list, sf_slab_run *run) {
+    run->prev = NULL;
+    run->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = run;
+    }
+    *list = run;
+}
+
+/**
+ * Finds a run with a free object of the given class, starting one on an empty run or
+ * a new page if needed.  Caller holds arena->lock.
+ */
+static sf_slab_run *slab_run(sf_arena *arena, int index, size_t size) {
+    if (arena->slab_runs[index] != NULL) {
+        return arena->slab_runs[index];
+    }
+
+    sf_slab_run *run = arena->slab_empty;
+    if (run != NULL) {
+        slab_unlink(&arena->slab_empty, run);
+    } else {
+        run = arena_slab_page(arena);
+        if (run == NULL) {
+            return NULL;
+        }
+        run->arena = arena;
+    }
+
+    // Every object also takes a byte for its requested size; one object fewer always
+    // makes room for rounding the first up to 16 bytes
+    int capacity = (PAGE_SZ - sizeof(sf_slab_run)) / (size + 1);
+    if (((sizeof(sf_slab_run) + capacity + 15) & ~15) + capacity * size > PAGE_SZ) {
+        capacity--;
+    }
+
+    run->size = size;
+    run->used = 0;
+    run->capacity = capacity;
+    run->objects = (sizeof(sf_slab_run) + capacity + 15) & ~15;
+    memset(run->requested, 0, capacity);
+    for (int i = 0; i < 4; i++) {
+        int bits = run->capacity - i * 64;
+        run->bitmap[i] = bits >= 64 ? 0 : bits <= 0 ? ~0ULL : ~0ULL << bits;
+    }
+
+    slab_push(&arena->slab_runs[index], run);
+    return run;
+}
+
+static inline size_t slab_object_index(sf_slab_run *run, void *ptr) {
+    return ((char *)ptr - SLAB_OBJECTS(run)) / run->size;
+}
+
+/**
+ * Takes a free object of the given class from the arena's runs.  Caller holds
+ * arena->lock.
+ *
+ * @return The object, or NULL if no run could be started.
+ */
+static void *slab_take(sf_arena *arena, int index, size_t object_size) {
+    sf_slab_run *run = slab_run(arena, index, object_size);
+    if (run == NULL) {
+        return NULL;
+    }
+
+    int word = 0;
+    while (run->bitmap[word] == ~0ULL) {
+        word++;
+    }
+    int bit = __builtin_ctzll(~run->bitmap[word]);
+    run->bitmap[word] |= 1ULL << bit;
+
+    if (++run->used == run->capacity) {
+        slab_unlink(&arena->slab_runs[index], run);
+    }
+
+    stat_add(&arena->allocated_bytes, object_size);
+    return SLAB_OBJECTS(run) + (word * 64 + bit) * object_size;
+}
+
+/**
+ * Gives an object back to its run.  Caller holds the run's arena lock.
+ */
+static void slab_put(sf_slab_run *run, void *ptr) {
+    sf_arena *arena = run->arena;
+    size_t object = slab_object_index(run, ptr);
+    uint64_t mask = 1ULL << (object % 64);
+    if ((run->bitmap[object / 64] & mask) == 0) {
+        abort(); // double free
+    }
+    run->bitmap[object / 64] &= ~mask;
+
+    int index = SLAB_INDEX(run->size);
+    if (run->used-- == run->capacity) {
+        slab_push(&arena->slab_runs[index], run);
+    }
+    if (run->used == 0) {
+        slab_unlink(&arena->slab_runs[index], run);
+        slab_push(&arena->slab_empty, run);
+    }
+
+    stat_add(&arena->allocated_bytes, -(size_t)run->size);
+}
+
+/**
+ * Fills half of an empty bin in one locked pass.
+ */
+static void slab_refill(sf_arena *arena, sf_slab_bin *bin, int index, size_t object_size) {
+    arena_lock(arena);
+    tcache_settle();
+
+    for (int want = (tcache_count + 1) / 2; want > 0; want--) {
+        void *ptr = slab_take(arena, index, object_size);
+        if (ptr == NULL) {
+            break;
+        }
+        *(void **)ptr = bin->first;
+        bin->first = ptr;
+        bin->length++;
+    }
+
+    arena_unlock(arena);
+}
+
+/**
+ * Gives all but the newest keep objects of a bin back to their runs in one locked pass.
+ */
+static void slab_drain(sf_arena *arena, sf_slab_bin *bin, int keep) {
+    void *stale = bin->first;
+    if (keep > 0) {
+        void *last_kept = bin->first;
+        for (int i = 1; i < keep && last_kept != NULL; i++) {
+            last_kept = *(void **)last_kept;
+        }
+        if (last_kept == NULL) {
+            return;
+        }
+        stale = *(void **)last_kept;
+        *(void **)last_kept = NULL;
+        bin->length = keep;
+    } else {
+        bin->first = NULL;
+        bin->length = 0;
+    }
+
+    arena_lock(arena);
+    tcache_settle();
+
+    while (stale != NULL) {
+        void *next = *(void **)stale;
+        slab_put(slab_run_of(stale), stale);
+        stale = next;
+    }
+
+    arena_unlock(arena);
+}
+
+/**
+ * Thread exit: give every object in the thread's bins back to its arena.
+ */
+void slab_release(sf_arena *arena) {
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        if (slab_bins[i].first != NULL) {
+            slab_drain(arena, &slab_bins[i], 0);
+        }
+    }
+}
+
+/**
+ * @return An object of at least size bytes, or NULL if no run could be started, in
+ * which case the caller falls back to the ordinary heap.
+ */
+void *slab_malloc(sf_arena *arena, size_t size) {
+    size_t object_size = (size + 15) & ~15;
+    int index = SLAB_INDEX(object_size);
+    void *ptr;
+
+    if (tcache_enabled()) {
+        sf_slab_bin *bin = &slab_bins[index];
+        if (bin->first == NULL) {
+            slab_refill(arena, bin, index, object_size);
+            if (bin->first == NULL) {
+                return NULL;
+            }
+        }
+
+        ptr = bin->first;
+        bin->first = *(void **)ptr;
+        bin->length--;
+
+        sf_slab_run *run = slab_run_of(ptr);
+        run->requested[slab_object_index(run, ptr)] = size;
+        tcache_adjust_payload(size);
+        return ptr;
+    }
+
+    arena_lock(arena);
+    ptr = slab_take(arena, index, object_size);
+    if (ptr != NULL) {
+        sf_slab_run *run = slab_run_of(ptr);
+        run->requested[slab_object_index(run, ptr)] = size;
+        adjust_payload(size);
+    }
+    arena_unlock(arena);
+    return ptr;
+}
+
+/**
+ * Frees ptr if it is a slab object, into the calling thread's bin if the object is
+ * from its arena and the per-thread caches are on.
+ *
+ * @return false if ptr is not in a slab run.
+ */
+bool slab_free(void *ptr) {
+    if (!arena_is_slab(ptr)) {
+        return false;
+    }
+
+    sf_slab_run *run = slab_run_of(ptr);
+    size_t object = slab_object_index(run, ptr);
+    size_t size = run->requested[object];
+    if (size == 0) {
+        abort(); // double free
+    }
+    run->requested[object] = 0;
+
+    sf_arena *arena = run->arena;
+    if (tcache_enabled() && arena == thread_arena()) {
+        sf_slab_bin *bin = &slab_bins[SLAB_INDEX(run->size)];
+        int count = __atomic_load_n(&tcache_count, __ATOMIC_RELAXED);
+        if (bin->length >= count) {
+            slab_drain(arena, bin, count / 2);
+        }
+
+        *(void **)ptr = bin->first;
+        bin->first = ptr;
+        bin->length++;
+        tcache_adjust_payload(-size);
+        return true;
+    }
+
+    arena_lock(arena);
+    slab_put(run, ptr);
+    adjust_payload(-size);
+    arena_unlock(arena);
+    return true;
+}
+
+/**
+ * Turns an empty run back into an ordinary page of its arena, for when the heap cannot
+ * grow any more.  Caller holds arena->lock.
+ *
+ * @return The page, or NULL if the arena has no empty run.
+ */
+void *slab_reclaim(sf_arena *arena) {
+    sf_slab_run *run = arena->slab_empty;
+    if (run == NULL) {
+        return NULL;
+    }
+
+    slab_unlink(&arena->slab_empty, run);
+    arena_slab_unmark(run);
+    return run;
+}
+
+/**
+ * @return The object size if ptr is a slab object, otherwise 0.
+ */
+size_t slab_size(void *ptr) {
+    if (!arena_is_slab(ptr)) {
+        return 0;
+    }
+    return slab_run_of(ptr)->size;
+}
+
+/**
+ * Steps over any slab pages starting at page, for heap walks.  Objects in a thread's
+ * bin count as allocated but hold no payload, like blocks in the tcache bins.  Caller
+ * holds every arena lock.
+ *
+ * @return The first address past the slab pages.
+ */
+char *slab_skip(char *page, size_t *payload, size_t *allocated) {
+    while (page < (char *)sf_mem_end() && arena_is_slab(page)) {
+        sf_slab_run *run = (sf_slab_run *)page;
+        if (run->used > 0) {
+            for (int i = 0; i < run->capacity; i++) {
+                *payload += run->requested[i];
+            }
+            *allocated += (size_t)run->used * run->size;
+        }
+        page += PAGE_SZ;
+    }
+    return page;
+}
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Per-thread caches in front of the quick lists.
+ *
+ * Each thread owns one LIFO bin per quick list size class, indexed the same way as
+ * sf_quick_lists.  Blocks sitting in a bin are marked allocated and IN_QUICK_LIST,
+ * exactly like quick list blocks, so the shared heap never coalesces them.  A bin only
+ * holds blocks from its thread's arena.  A hit in the bin is served without taking the
+ * arena lock; a miss refills half a bin in one locked pass, and an overflowing bin
+ * drains its oldest half back in one locked pass.
+ *
+ * While only one thread has called into the allocator the quick lists already act as
+ * that thread's cache, so the bins stay out of the way until a second thread shows up.
+ */
+
+typedef struct {
+    int length;             // Number of blocks currently in the bin.
+    struct sf_block *first; // Most recently cached block.
+} sf_tcache_bin;
+
+typedef struct {
+    size_t payload_delta;   // Payload allocated minus freed since the last locked pass.
+    sf_tcache_bin bins[NUM_QUICK_LISTS];
+} sf_tcache;
+
+int tcache_count = 16;
+
+static __thread sf_tcache tcache;
+
+/**
+ * Folds the thread's payload delta into the heap-wide totals.  Caller holds the arena lock.
+ */
+static void tcache_flush_payload(void) {
+    adjust_payload(tcache.payload_delta);
+    tcache.payload_delta = 0;
+}
+
+/**
+ * Folds the calling thread's payload delta into the totals outside a locked pass, so
+ * that sf_fragmentation() counts this thread's cached frees.  adjust_payload() is
+ * atomic, so no lock is needed.
+ */
+void tcache_settle(void) {
+    if (tcache.payload_delta != 0) {
+        tcache_flush_payload();
+    }
+}
+
+/**
+ * Counts payload handed out, or taken back if delta is negative, by another per-thread
+ * cache (the slab bins), to be folded in along with the thread's own.
+ */
+void tcache_adjust_payload(size_t delta) {
+    tcache.payload_delta += delta;
+}
+
+static inline void tcache_push(sf_tcache_bin *bin, sf_block *block) {
+    block->body.links.next = bin->first;
+    bin->first = block;
+    bin->length++;
+}
+
+/**
+ * Carves up to n blocks of block_size out of a single free block and caches them in bin.
+ * Caller holds the arena lock.
+ *
+ * @return The number of blocks carved.
+ */
+static int tcache_carve(sf_arena *arena, sf_tcache_bin *bin, size_t block_size, int n) {
+    sf_block *block = find_free_block(arena, block_size * n);
+    if (block == NULL) {
+        block = find_free_block(arena, block_size);
+        if (block == NULL) {
+            return 0;
+        }
+    }
+
+    size_t free_size = ((uint32_t)(block->header ^ MAGIC)) & ~0xF;
+    int count = free_size / block_size;
+    if (count > n) {
+        count = n;
+    }
+
+    // Never leave a splinter behind
+    size_t leftover = free_size - count * block_size;
+    if (leftover > 0 && leftover < MIN_BLOCK_SIZE) {
+        count--;
+        leftover += block_size;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    remove_free_block(arena, block);
+
+    stat_add(&arena->stats.free_list_hits[get_free_list_index(free_size)], 1);
+    stat_add(&arena->stats.splits, leftover > 0);
+    stat_live(arena, block_size, count);
+    stat_add(&arena->allocated_bytes, count * block_size);
+
+    char *curr = (char *)block;
+    // A free block always follows an allocated one, and so does each block carved after it
+    for (int i = 0; i < count; i++) {
+        set_allocated_header((sf_block *)curr, block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST | PREV_BLOCK_ALLOCATED);
+        tcache_push(bin, (sf_block *)curr);
+        curr += block_size;
+    }
+
+    if (leftover > 0) {
+        sf_block *rest = (sf_block *)curr;
+        rest->header = ((uint64_t)leftover | ((block->header ^ MAGIC) & KNOWN_ZERO)) ^ MAGIC;
+        set_free_list_next(arena, rest, NULL);
+        set_free_list_prev(arena, rest, NULL);
+        insert_free_block(arena, rest);
+    } else {
+        set_prev_allocated((sf_block *)curr, true);
+    }
+
+    return count;
+}
+
+/**
+ * Refills half of an empty bin from the shared quick list, then from the free lists.
+ * Heap growth is left to the locked sf_malloc path, which runs if this comes back empty.
+ */
+static void tcache_refill(sf_arena *arena, int index, size_t block_size) {
+    sf_tcache_bin *bin = &tcache.bins[index];
+    int want = (tcache_count + 1) / 2;
+
+    arena_lock(arena);
+
+    tcache_flush_payload();
+    arena_drain_remote(arena);
+
+    while (want > 0 && arena->quick_lists[index].first != NULL) {
+        sf_block *block = arena->quick_lists[index].first;
+        arena->quick_lists[index].first = block->body.links.next;
+        arena->quick_lists[index].length--;
+        stat_add(&arena->stats.quick_hits[index], 1);
+        stat_live(arena, block_size, 1);
+
+        tcache_push(bin, block);
+        want--;
+    }
+
+    if (want > 0) {
+        tcache_carve(arena, bin, block_size, want);
+    }
+
+    arena_unlock(arena);
+}
+
+/**
+ * Returns all but the newest keep blocks of a bin to the shared heap in one locked pass.
+ */
+static void tcache_drain(sf_arena *arena, int index, int keep) {
+    sf_tcache_bin *bin = &tcache.bins[index];
+
+    sf_block *stale = bin->first;
+    if (keep > 0) {
+        sf_block *last_kept = bin->first;
+        for (int i = 1; i < keep && last_kept != NULL; i++) {
+            last_kept = last_kept->body.links.next;
+        }
+        if (last_kept == NULL) {
+            return;
+        }
+        stale = last_kept->body.links.next;
+        last_kept->body.links.next = NULL;
+        bin->length = keep;
+    } else {
+        bin->first = NULL;
+        bin->length = 0;
+    }
+
+    arena_lock(arena);
+
+    tcache_flush_payload();
+
+    while (stale != NULL) {
+        sf_block *next = stale->body.links.next;
+        free_locked(arena, (char *)stale + sizeof(sf_header));
+        stale = next;
+    }
+
+    arena_unlock(arena);
+}
+
+/**
+ * Thread exit: give every cached block back to the thread's arena.
+ */
+void tcache_release(sf_arena *arena) {
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        if (tcache.bins[i].first != NULL) {
+            tcache_drain(arena, i, 0);
+        }
+    }
+
+    arena_lock(arena);
+    tcache_flush_payload();
+    arena_unlock(arena);
+}
+
+/**
+ * Serves a small request from the calling thread's cache, refilling the bin if needed.
+ *
+ * @return The payload pointer, or NULL if the caches are disabled or could not be
+ * refilled, in which case the caller falls back to the locked path.
+ */
+void *tcache_malloc(sf_arena *arena, size_t size, size_t aligned_size) {
+    if (!tcache_enabled()) {
+        return NULL;
+    }
+
+    int index = QUICK_LIST_INDEX(aligned_size);
+    sf_tcache_bin *bin = &tcache.bins[index];
+
+    if (bin->first == NULL) {
+        tcache_refill(arena, index, aligned_size);
+        if (bin->first == NULL) {
+            return NULL;
+        }
+    }
+
+    sf_block *block = bin->first;
+    bin->first = block->body.links.next;
+    bin->length--;
+
+    set_unlocked_header(block, ((uint64_t)size << 32) | aligned_size | THIS_BLOCK_ALLOCATED);
+
+    tcache.payload_delta += size;
+    return (void *)((char *)block + sizeof(sf_header));
+}
+
+/**
+ * Caches a freed small block in the calling thread's bin, draining the bin's oldest
+ * half first if it is full.
+ *
+ * @return true if the block was cached, false if the caller should free it normally.
+ */
+bool tcache_free(sf_arena *arena, sf_block *block, size_t block_size) {
+    if (!tcache_enabled()) {
+        return false;
+    }
+
+    int index = QUICK_LIST_INDEX(block_size);
+    sf_tcache_bin *bin = &tcache.bins[index];
+    int count = __atomic_load_n(&tcache_count, __ATOMIC_RELAXED);
+
+    if (bin->length >= count) {
+        tcache_drain(arena, index, count / 2);
+    }
+
+    tcache.payload_delta -= (block->header ^ MAGIC) >> 32;
+    set_unlocked_header(block, block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST);
+    tcache_push(bin, block);
+    return true;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_internal.h"
+
+/*
+ * Best-fit index for large free blocks.
+ *
+ * Free blocks larger than tree_threshold are kept in a per-arena treap keyed by
+ * (block size, address), in addition to their free list.  A block's priority is a hash
+ * of its address, so the tree stays balanced in expectation without storing anything
+ * besides the two child pointers, which live in the payload right after the list links.
+ */
+
+typedef struct {
+    sf_block *left;
+    sf_block *right;
+} sf_tree_links;
+
+size_t tree_threshold = MIN_BLOCK_SIZE << (NUM_FREE_LISTS - 2);
+
+static inline sf_tree_links *tree_links(sf_block *block) {
+    return (sf_tree_links *)((char *)block + sizeof(sf_header) + sizeof(block->body.links));
+}
+
+static inline size_t tree_size(sf_block *block) {
+    return ((uint32_t)(block->header ^ MAGIC)) & ~0xF;
+}
+
+static inline uint32_t tree_priority(sf_block *block) {
+    return ((uintptr_t)block * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static inline bool tree_less(sf_block *a, sf_block *b) {
+    size_t a_size = tree_size(a);
+    size_t b_size = tree_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+static void tree_insert_at(sf_block **root, sf_block *block) {
+    if (*root == NULL) {
+        tree_links(block)->left = NULL;
+        tree_links(block)->right = NULL;
+        *root = block;
+        return;
+    }
+
+    sf_block *node = *root;
+    if (tree_less(block, node)) {
+        tree_insert_at(&tree_links(node)->left, block);
+        sf_block *child = tree_links(node)->left;
+        if (tree_priority(child) > tree_priority(node)) {
+            tree_links(node)->left = tree_links(child)->right;
+            tree_links(child)->right = node;
+            *root = child;
+        }
+    } else {
+        tree_insert_at(&tree_links(node)->right, block);
+        sf_block *child = tree_links(node)->right;
+        if (tree_priority(child) > tree_priority(node)) {
+            tree_links(node)->right = tree_links(child)->left;
+            tree_links(child)->left = node;
+            *root = child;
+        }
+    }
+}
+
+/**
+ * Joins two treaps where every key in left is smaller than every key in right.
+ */
+static sf_block *tree_merge(sf_block *left, sf_block *right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+
+    if (tree_priority(left) > tree_priority(right)) {
+        tree_links(left)->right = tree_merge(tree_links(left)->right, right);
+        return left;
+    }
+    tree_links(right)->left = tree_merge(left, tree_links(right)->left);
+    return right;
+}
+
+/**
+ * Adds a free block to the arena's tree.  Caller holds arena->lock.
+ */
+void tree_insert(sf_arena *arena, sf_block *block) {
+    tree_insert_at(&arena->tree_root, block);
+}
+
+/**
+ * Takes a free block out of the arena's tree.  Caller holds arena->lock.
+ */
+void tree_remove(sf_arena *arena, sf_block *block) {
+    sf_block **link = &arena->tree_root;
+    while (*link != NULL && *link != block) {
+        link = tree_less(block, *link) ? &tree_links(*link)->left : &tree_links(*link)->right;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    *link = tree_merge(tree_links(block)->left, tree_links(block)->right);
+}
+
+/**
+ * @return The smallest block in the arena's tree of at least size bytes, lowest address
+ * first among equals, or NULL if there is none.  Caller holds arena->lock.
+ */
+sf_block *tree_best_fit(sf_arena *arena, size_t size) {
+    sf_block *best = NULL;
+    sf_block *node = arena->tree_root;
+    while (node != NULL) {
+        if (tree_size(node) >= size) {
+            best = node;
+            node = tree_links(node)->left;
+        } else {
+            node = tree_links(node)->right;
+        }
+    }
+    return best;
+}
+
+/**
+ * @return The largest block in the arena's tree, or NULL if it is empty.  Caller holds
+ * arena->lock.
+ */
+sf_block *tree_largest(sf_arena *arena) {
+    sf_block *node = arena->tree_root;
+    while (node != NULL && tree_links(node)->right != NULL) {
+        node = tree_links(node)->right;
+    }
+    return node;
+}
+
+/**
+ * Sets the size above which free blocks go in the tree.  Only possible before the heap
+ * exists, so that every free block is filed the same way it will be looked up.
+ */
+int tree_set_threshold(int threshold) {
+    if (threshold < MIN_BLOCK_SIZE || arena_heap_size() != 0) {
+        return 0;
+    }
+    tree_threshold = threshold;
+    return 1;
+}
@@ -0,0 +1,131 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
+
+/*
+ * Returning free memory to the system.
+ *
+ * sf_mem_grow() has no counterpart that shrinks the heap, so the pages of a free block
+ * are handed back with madvise(MADV_DONTNEED) instead, whether the block is the tail
+ * of a segment or in the middle.  The block keeps its place in the heap and its free
+ * list; only the whole pages past its header, list links and a word recording how many
+ * bytes were released are discarded.  Such a block has the PAGES_RELEASED bit set, and
+ * the released bytes are counted out of arena_heap_size() until the block leaves its
+ * free list.  sf_utilization() divides by the peak of that size, which trimming leaves
+ * alone, so it never exceeds 1.
+ */
+
+size_t trim_threshold = 0;
+
+/* Bytes at the start of a free block that are never released. */
+#define TRIM_KEEP (sizeof(sf_header) + 4 * sizeof(sf_block *))
+
+static inline size_t *trim_released(sf_block *block) {
+    return (size_t *)((char *)block + TRIM_KEEP);
+}
+
+/**
+ * Releases the whole pages of a free block beyond its first pad bytes.  Caller holds
+ * the arena lock.
+ *
+ * @return The number of bytes released.
+ */
+static size_t trim_block(sf_block *block, size_t pad) {
+    uint64_t header = block->header ^ MAGIC;
+    if (header & PAGES_RELEASED) {
+        return 0;
+    }
+
+    size_t size = (uint32_t)header & ~0xF;
+    uintptr_t start = ((uintptr_t)block + TRIM_KEEP + sizeof(size_t) + pad + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uintptr_t end = ((uintptr_t)block + size - sizeof(sf_footer)) & ~(PAGE_SZ - 1);
+    if (end <= start || madvise((void *)start, end - start, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+
+    *trim_released(block) = end - start;
+    block->header = (header | PAGES_RELEASED) ^ MAGIC;
+    *(sf_footer *)((char *)block + size - sizeof(sf_footer)) = block->header;
+
+    arena_heap_release(end - start);
+    return end - start;
+}
+
+/**
+ * Called as a block with PAGES_RELEASED leaves its free list: its pages are about to
+ * be used again, so they count towards the heap size once more.
+ */
+void trim_reclaim(sf_block *block) {
+    arena_heap_reclaim(*trim_released(block));
+}
+
+/**
+ * Makes freshly grown heap pages read as zeros.  sf_mem_grow() does not clear them, but
+ * whole pages dropped with madvise() come back zero-filled without being touched here;
+ * only the partial pages at either end are cleared by hand.
+ *
+ * @return false if the pages could not be released, in which case they are left as is.
+ */
+bool trim_zero(void *start, size_t size) {
+    uintptr_t first = ((uintptr_t)start + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uintptr_t last = ((uintptr_t)start + size) & ~(PAGE_SZ - 1);
+    if (last <= first) {
+        memset(start, 0, size);
+        return true;
+    }
+    if (madvise((void *)first, last - first, MADV_DONTNEED) != 0) {
+        return false;
+    }
+
+    memset(start, 0, first - (uintptr_t)start);
+    memset((void *)last, 0, (uintptr_t)start + size - last);
+    return true;
+}
+
+/**
+ * Releases an arena's tail block once it exceeds trim_threshold.  Caller holds the
+ * arena lock.
+ */
+void trim_tail(sf_arena *arena) {
+    if (trim_threshold == 0 || arena->heap_end == NULL) {
+        return;
+    }
+
+    // The epilogue says whether the block before it is free, and only then is its size known
+    sf_block *epilogue = (sf_block *)(arena->heap_end - sizeof(sf_header));
+    if ((epilogue->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) {
+        return;
+    }
+
+    size_t tail_size = prev_free_size(epilogue);
+    if (tail_size > trim_threshold) {
+        trim_block((sf_block *)(arena->heap_end - sizeof(sf_header) - tail_size), 0);
+    }
+}
+
+int sf_trim(size_t pad) {
+    size_t released = 0;
+
+    arena_lock_all();
+    sf_arena *arena;
+    for (int i = 0; (arena = arena_at(i)) != NULL; i++) {
+        defer_consolidate(arena);
+        for (int j = 0; j < NUM_FREE_LISTS; j++) {
+            sf_block *head = &arena->free_list_heads[j];
+            for (sf_block *block = free_list_next(arena, head); block != head; block = free_list_next(arena, block)) {
+                // Only the block before an epilogue keeps the requested slack
+                sf_block *next = (sf_block *)((char *)block + ((uint32_t)(block->header ^ MAGIC) & ~0xF));
+                bool tail = (next->header ^ MAGIC) == THIS_BLOCK_ALLOCATED;
+                released += trim_block(block, tail ? pad : 0);
+            }
+        }
+    }
+    arena_unlock_all();
+
+    return released > 0;
+}
@@ -1,10 +1,28 @@
 #include <criterion/criterion.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfmm_internal.h"
 #define TEST_TIMEOUT 15
 
+/*
+ * The block after bp on one of arena 0's free lists, read through free_list_next() so
+ * that compact links (-DCOMPACT_LINKS) are decoded too.
+ */
+static sf_block *next_free_block(sf_block *bp) {
+    return free_list_next(arena_at(0), bp);
+}
+
+/* What a heap segment spends on its padding, prologue and epilogue. */
+#define SEGMENT_OVERHEAD (8 + MIN_BLOCK_SIZE + 8)
+
+/* The free block of a fresh page. */
+#define PAGE_FREE_SIZE (PAGE_SZ - SEGMENT_OVERHEAD)
+
 /*
  * Assert the total number of free blocks of a specified size.
  * If size == 0, then assert the total number of all free blocks.
@@ -12,11 +30,11 @@
 void assert_free_block_count(size_t size, int count) {
     int cnt = 0;
     for(int i = 0; i < NUM_FREE_LISTS; i++) {
-        sf_block *bp = sf_free_list_heads[i].body.links.next;
+        sf_block *bp = next_free_block(&sf_free_list_heads[i]);
         while(bp != &sf_free_list_heads[i]) {
 	    if(size == 0 || size == ((bp->header ^ sf_magic()) & ~0xffffffff0000000f))
 	        cnt++;
-	    bp = bp->body.links.next;
+	    bp = next_free_block(bp);
 	}
     }
     if(size == 0) {
@@ -66,7 +84,7 @@ Test(sfmm_basecode_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
 
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(4016, 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz), 1);
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 	cr_assert(sf_mem_start() + PAGE_SZ == sf_mem_end(), "Allocated more than necessary!");
@@ -78,7 +96,7 @@ Test(sfmm_basecode_suite, malloc_four_pages, .timeout = TEST_TIMEOUT) {
 
 	// We want to allocate up to exactly four pages, so there has to be space
 	// for the header and the link pointers.
-	void *x = sf_malloc(16316);
+	void *x = sf_malloc(USABLE_SIZE(4 * PAGE_SZ - SEGMENT_OVERHEAD));
 	cr_assert_not_null(x, "x is NULL!");
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 0);
@@ -87,12 +105,13 @@ Test(sfmm_basecode_suite, malloc_four_pages, .timeout = TEST_TIMEOUT) {
 
 Test(sfmm_basecode_suite, malloc_too_large, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
-	void *x = sf_malloc(151505);
+	// One byte more than the whole 37-page heap can hold
+	void *x = sf_malloc(USABLE_SIZE(151552 - SEGMENT_OVERHEAD) + 1);
 
 	cr_assert_null(x, "x is not NULL!");
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(151504, 1);
+	assert_free_block_count(151552 - SEGMENT_OVERHEAD, 1);
 	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
 }
 
@@ -106,15 +125,15 @@ Test(sfmm_basecode_suite, free_quick, .timeout = TEST_TIMEOUT) {
 	sf_free(y);
 
 	assert_quick_list_block_count(0, 1);
-	assert_quick_list_block_count(48, 1);
+	assert_quick_list_block_count(block_size_for(sz_y), 1);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(3936, 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_x) - block_size_for(sz_y) - block_size_for(sz_z), 1);
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
 
 Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
-	size_t sz_x = 8, sz_y = 200, sz_z = 1;
+	size_t sz_x = 8, sz_y = 240, sz_z = 1;
 	/* void *x = */ sf_malloc(sz_x);
 	void *y = sf_malloc(sz_y);
 	/* void *z = */ sf_malloc(sz_z);
@@ -123,15 +142,15 @@ Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 2);
-	assert_free_block_count(224, 1);
-	assert_free_block_count(3760, 1);
+	assert_free_block_count(block_size_for(sz_y), 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_x) - block_size_for(sz_y) - block_size_for(sz_z), 1);
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
 
 Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
-	size_t sz_w = 8, sz_x = 200, sz_y = 300, sz_z = 4;
+	size_t sz_w = 8, sz_x = 240, sz_y = 300, sz_z = 4;
 	/* void *w = */ sf_malloc(sz_w);
 	void *x = sf_malloc(sz_x);
 	void *y = sf_malloc(sz_y);
@@ -142,14 +161,15 @@ Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 2);
-	assert_free_block_count(544, 1);
-	assert_free_block_count(3440, 1);
+	assert_free_block_count(block_size_for(sz_x) + block_size_for(sz_y), 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_w) - block_size_for(sz_x) - block_size_for(sz_y) -
+				block_size_for(sz_z), 1);
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
 
 Test(sfmm_basecode_suite, freelist, .timeout = TEST_TIMEOUT) {
-        size_t sz_u = 200, sz_v = 300, sz_w = 200, sz_x = 500, sz_y = 200, sz_z = 700;
+        size_t sz_u = 240, sz_v = 300, sz_w = 240, sz_x = 500, sz_y = 240, sz_z = 700;
 	void *u = sf_malloc(sz_u);
 	/* void *v = */ sf_malloc(sz_v);
 	void *w = sf_malloc(sz_w);
@@ -163,12 +183,13 @@ Test(sfmm_basecode_suite, freelist, .timeout = TEST_TIMEOUT) {
 
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 4);
-	assert_free_block_count(224, 3);
-	assert_free_block_count(1808, 1);
+	assert_free_block_count(block_size_for(sz_u), 3);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_u) - block_size_for(sz_v) - block_size_for(sz_w) -
+				block_size_for(sz_x) - block_size_for(sz_y) - block_size_for(sz_z), 1);
 
 	// First block in list should be the most recently freed block.
-	int i = 3;
-	sf_block *bp = sf_free_list_heads[i].body.links.next;
+	int i = get_free_list_index(block_size_for(sz_y));
+	sf_block *bp = next_free_block(&sf_free_list_heads[i]);
 	cr_assert_eq(bp, (char *)y - 8,
 		     "Wrong first block in free list %d: (found=%p, exp=%p)",
                      i, bp, (char *)y - 8);
@@ -183,14 +204,14 @@ Test(sfmm_basecode_suite, realloc_larger_block, .timeout = TEST_TIMEOUT) {
 	cr_assert_not_null(x, "x is NULL!");
 	sf_block *bp = (sf_block *)((char *)x - 8);
 	cr_assert((bp->header ^ sf_magic()) & 0x1, "Allocated bit is not set!");
-	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == 96,
+	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == block_size_for(sz_x1),
 		  "Realloc'ed block size (%ld) not what was expected (%ld)!",
-		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, 96);
+		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, block_size_for(sz_x1));
 
 	assert_quick_list_block_count(0, 1);
-	assert_quick_list_block_count(32, 1);
+	assert_quick_list_block_count(block_size_for(sz_x), 1);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(3888, 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_x) - block_size_for(sz_y) - block_size_for(sz_x1), 1);
 }
 
 Test(sfmm_basecode_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOUT) {
@@ -201,16 +222,19 @@ Test(sfmm_basecode_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOU
 	cr_assert_not_null(y, "y is NULL!");
 	cr_assert(x == y, "Payload addresses are different!");
 
+	// With 16-byte minimum blocks (-DCOMPACT_LINKS) the difference is a block of its own
+	size_t bsz = block_size_for(sz_x) - block_size_for(sz_y) < MIN_BLOCK_SIZE ? block_size_for(sz_x) :
+		     block_size_for(sz_y);
 	sf_block *bp = (sf_block *)((char *)x - 8);
 	cr_assert((bp->header ^ sf_magic()) & 0x1, "Allocated bit is not set!");
-	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == 96,
+	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == bsz,
 		  "Realloc'ed block size (%ld) not what was expected (%ld)!",
-		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, 96);
+		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, bsz);
 
 	// There should be only one free block.
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(3952, 1);
+	assert_free_block_count(PAGE_FREE_SIZE - bsz, 1);
 }
 
 Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIMEOUT) {
@@ -222,9 +246,9 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 
 	sf_block *bp = (sf_block *)((char *)x - 8);
 	cr_assert((bp->header ^ sf_magic()) & 0x1, "Allocated bit is not set!");
-	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == 32,
+	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == block_size_for(sz_y),
 		  "Realloc'ed block size (%ld) not what was expected (%ld)!",
-		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, 32);
+		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, block_size_for(sz_y));
 
 	// After realloc'ing x, we can return a block of size ADJUSTED_BLOCK_SIZE(sz_x) - ADJUSTED_BLOCK_SIZE(sz_y)
 	// to the freelist.  This block will go into the main freelist and be coalesced.
@@ -232,7 +256,7 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 	// that were requested by the client, so they are not very likely to satisfy a new request.
 	assert_quick_list_block_count(0, 0);	
 	assert_free_block_count(0, 1);
-	assert_free_block_count(4016, 1);
+	assert_free_block_count(PAGE_FREE_SIZE - block_size_for(sz_y), 1);
 }
 
 //############################################
@@ -363,14 +387,14 @@ Test(sfmm_student_suite, student_test_4_quicklist_flush, .timeout = TEST_TIMEOUT
 
 Test(sfmm_student_suite, student_test_5_coalesce_prev, .timeout = TEST_TIMEOUT) {
     sf_errno = 0;
-    void *a = sf_malloc(200);
-    void *b = sf_malloc(200);
+    void *a = sf_malloc(240);
+    void *b = sf_malloc(240);
 	sf_malloc(4);
     sf_free(a);  // A becomes free
     sf_free(b);  // Should coalesce with A
 
     assert_free_block_count(0, 2);
-    assert_free_block_count(224 + 224, 1); // Combined size of both
+    assert_free_block_count(2 * block_size_for(240), 1); // Combined size of both
 	//sf_show_heap();
 }
 
@@ -434,3 +458,714 @@ Test(sfmm_student_suite, student_test_10_heap_grow, .timeout = TEST_TIMEOUT) {
     cr_assert_not_null(ptr, "Malloc failed on large request.");
     cr_assert(sf_mem_end() > sf_mem_start() + PAGE_SZ, "Heap did not grow.");
 }
+
+static void *thread_cache_worker(void *arg) {
+    char id = (char)(long)arg;
+    void *ptrs[32];
+
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 32; i++) {
+            ptrs[i] = sf_malloc(8 + (i % 4) * 16);
+            if (ptrs[i] == NULL)
+                return (void *)1;
+            memset(ptrs[i], id, 8);
+        }
+        for (int i = 0; i < 32; i++) {
+            if (*(char *)ptrs[i] != id)
+                return (void *)1;
+            sf_free(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+Test(sfmm_student_suite, student_test_11_thread_cache, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    pthread_t threads[4];
+
+    for (long i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, thread_cache_worker, (void *)(i + 1));
+    for (int i = 0; i < 4; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        cr_assert_null(result, "Thread %d saw a bad allocation!", i);
+    }
+
+    // Exiting threads hand their cached blocks back, so every byte is accounted for.
+    size_t total = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++)
+        for (sf_block *bp = next_free_block(&sf_free_list_heads[i]); bp != &sf_free_list_heads[i];
+             bp = next_free_block(bp))
+            total += (bp->header ^ sf_magic()) & ~0xffffffff0000000f;
+    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+        for (sf_block *bp = sf_quick_lists[i].first; bp != NULL; bp = bp->body.links.next)
+            total += (bp->header ^ sf_magic()) & ~0xffffffff0000000f;
+
+    size_t heap = (char *)sf_mem_end() - (char *)sf_mem_start();
+    cr_assert_eq(total, heap - SEGMENT_OVERHEAD, "Blocks missing after threads exited (exp=%ld, found=%ld)",
+                 heap - SEGMENT_OVERHEAD, total);
+}
+
+static void *arena_worker(void *arg) {
+    void *p = sf_malloc(1000);
+    *(void **)arg = p;
+    sf_free(p);
+    return NULL;
+}
+
+Test(sfmm_student_suite, student_test_12_arenas, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_ARENA_COUNT, 2), "Could not set the arena count!");
+
+    void *x = sf_malloc(1000);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(!sf_mallopt(SF_OPT_ARENA_COUNT, 4), "Arena count changed after the first malloc!");
+
+    // The second thread gets its own arena, which starts its own segment on a fresh page.
+    pthread_t thread;
+    void *y = NULL;
+    pthread_create(&thread, NULL, arena_worker, &y);
+    pthread_join(thread, NULL);
+
+    cr_assert_not_null(y, "y is NULL!");
+    cr_assert((char *)y >= (char *)sf_mem_start() + PAGE_SZ, "Second arena allocated from the first arena's page!");
+    cr_assert(sf_mem_start() + 2 * PAGE_SZ == sf_mem_end(), "Expected one page per arena!");
+
+    // Freeing in the other arena leaves this arena's free list alone.
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_FREE_SIZE - block_size_for(1000), 1);
+}
+
+static void *remote_block;
+static int remote_freed;
+
+static void *remote_free_worker(void *arg) {
+    remote_block = sf_malloc(1000);
+    __atomic_store_n(&remote_freed, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&remote_freed, __ATOMIC_ACQUIRE) != 2)
+        ;
+    // The block queued by the main thread is reclaimed before the free lists are searched.
+    return sf_malloc(1000);
+}
+
+Test(sfmm_student_suite, student_test_13_remote_free, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_ARENA_COUNT, 2), "Could not set the arena count!");
+    sf_malloc(8);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, remote_free_worker, NULL);
+    while (__atomic_load_n(&remote_freed, __ATOMIC_ACQUIRE) != 1)
+        ;
+    sf_free(remote_block);
+    __atomic_store_n(&remote_freed, 2, __ATOMIC_RELEASE);
+
+    void *again;
+    pthread_join(thread, &again);
+    cr_assert_eq(again, remote_block, "Remotely freed block was not reused (exp=%p, found=%p)",
+                 remote_block, again);
+
+    // Only this arena's own free block is on its list.
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_FREE_SIZE - block_size_for(8), 1);
+}
+
+Test(sfmm_student_suite, student_test_14_sub_lists, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    void *a = sf_malloc(1900);
+    sf_malloc(8);
+    void *b = sf_malloc(1100);
+    sf_malloc(8);
+
+    // Both land on one free list; b's smaller sub-list goes first even though it was freed first.
+    sf_free(b);
+    sf_free(a);
+    int i = get_free_list_index(block_size_for(1900));
+    cr_assert_eq(i, get_free_list_index(block_size_for(1100)), "Blocks not on the same free list!");
+    cr_assert_eq((char *)next_free_block(&sf_free_list_heads[i]) + 8, (char *)b,
+                 "Free list %d is not ordered by sub-list!", i);
+
+    void *x = sf_malloc(1800);
+    cr_assert_eq(x, a, "1800 bytes not served from the 1920-byte block (exp=%p, found=%p)", a, x);
+    void *y = sf_malloc(1000);
+    cr_assert_eq(y, b, "1000 bytes not served from the 1120-byte block (exp=%p, found=%p)", b, y);
+
+    // Both remainders come out the same size, with footers or without.
+    assert_free_block_count(0, 3);
+    assert_free_block_count(block_size_for(1900) - block_size_for(1800), 2);
+    assert_free_block_count(PAGE_FREE_SIZE - block_size_for(1900) - block_size_for(1100) - 2 * block_size_for(8), 1);
+}
+
+Test(sfmm_student_suite, student_test_15_tree_best_fit, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_TREE_THRESHOLD, 256), "Could not set the tree threshold!");
+
+    void *a = sf_malloc(528);
+    sf_malloc(8);
+    void *b = sf_malloc(544);
+    sf_malloc(8);
+    cr_assert(!sf_mallopt(SF_OPT_TREE_THRESHOLD, 1024), "Tree threshold changed after the first malloc!");
+
+    // The 544- and 560-byte blocks share a sub-list; the most recently freed one is not the best fit.
+    sf_free(a);
+    sf_free(b);
+
+    void *x = sf_malloc(524);
+    cr_assert_eq(x, a, "Best fit not chosen (exp=%p, found=%p)", a, x);
+
+    assert_free_block_count(0, 2);
+    assert_free_block_count(block_size_for(544), 1);
+}
+
+Test(sfmm_student_suite, student_test_16_grow_chunk, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_GROW_CHUNK, 16384), "Could not set the growth chunk!");
+
+    void *x = sf_malloc(8);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(sf_mem_start() + 16384 == sf_mem_end(), "Heap did not grow by a whole chunk!");
+    assert_free_block_count(16384 - SEGMENT_OVERHEAD - block_size_for(8), 1);
+
+    // The free tail covers most of the request; the rest is still rounded up to a chunk.
+    void *y = sf_malloc(20000);
+    cr_assert_not_null(y, "y is NULL!");
+    cr_assert(sf_mem_start() + 32768 == sf_mem_end(), "Heap did not grow by one more chunk!");
+    assert_free_block_count(0, 1);
+    assert_free_block_count(32768 - SEGMENT_OVERHEAD - block_size_for(8) - block_size_for(20000), 1);
+}
+
+Test(sfmm_student_suite, student_test_17_mmap, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_MMAP_THRESHOLD, 65536), "Could not set the mmap threshold!");
+
+    // Bigger than the heap could ever grow, so this can only succeed through a mapping.
+    char *x = sf_malloc(200000);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert(((uintptr_t)x & 15) == 0, "x is not 16-byte aligned!");
+    cr_assert(sf_mem_start() == sf_mem_end(), "Mapped allocation grew the heap!");
+
+    memset(x, 'a', 200000);
+    x = sf_realloc(x, 400000);
+    cr_assert_not_null(x, "Realloc returned NULL!");
+    cr_assert(x[0] == 'a' && x[199999] == 'a', "Realloc lost the contents!");
+    memset(x, 'b', 400000);
+
+    // Shrinking below the threshold moves the block into the heap.
+    x = sf_realloc(x, 1000);
+    cr_assert_not_null(x, "Realloc returned NULL!");
+    cr_assert(x >= (char *)sf_mem_start() && x < (char *)sf_mem_end(), "Small block not in the heap!");
+    cr_assert(x[0] == 'b' && x[999] == 'b', "Realloc lost the contents!");
+
+    sf_free(sf_malloc(100000));
+    sf_free(x);
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_FREE_SIZE, 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_18_realloc_in_place, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    void *a = sf_malloc(300);
+    char *b = sf_malloc(300);
+    void *c = sf_malloc(300);
+    sf_malloc(8);
+    memset(b, 'b', 300);
+
+    // Forward: b swallows the freed c.
+    sf_free(c);
+    char *x = sf_realloc(b, 500);
+    cr_assert_eq(x, b, "Realloc did not absorb the next block (exp=%p, found=%p)", b, x);
+    memset(x + 300, 'b', 200);
+
+    // Backward: b slides down into the freed a, taking the remainder after it too.
+    sf_free(a);
+    x = sf_realloc(x, 900);
+    cr_assert_eq(x, a, "Realloc did not expand backward (exp=%p, found=%p)", a, x);
+    cr_assert(x[0] == 'b' && x[499] == 'b', "Realloc lost the contents!");
+
+    // Tail: the heap grows right behind the last block.
+    char *t = sf_malloc(3000);
+    void *u = sf_realloc(t, 5000);
+    cr_assert_eq(u, t, "Realloc did not extend the heap tail (exp=%p, found=%p)", t, u);
+    cr_assert(sf_mem_start() + 2 * PAGE_SZ == sf_mem_end(), "Expected a two-page heap!");
+
+    assert_free_block_count(0, 2);
+    assert_free_block_count(3 * block_size_for(300) - block_size_for(900), 1);
+    assert_free_block_count(PAGE_FREE_SIZE + PAGE_SZ - 3 * block_size_for(300) - block_size_for(8) - block_size_for(5000), 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_19_trim, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    sf_free(sf_malloc(20000));
+    double full = sf_utilization();
+    size_t heap = (char *)sf_mem_end() - (char *)sf_mem_start();
+
+    // Releasing the free tail's pages takes them out of the resident heap size.
+    cr_assert(sf_trim(0), "Nothing was trimmed!");
+    size_t released = heap - arena_heap_size();
+    cr_assert_geq(released, 4 * PAGE_SZ, "Too little was released (%zu bytes)!", released);
+    cr_assert_eq(released % PAGE_SZ, 0, "Released a partial page!");
+    cr_assert(sf_utilization() == full && full <= 1.0, "Trimming changed utilization!");
+    assert_free_block_count(0, 1);
+    assert_free_block_count(5 * PAGE_SZ - SEGMENT_OVERHEAD, 1);
+
+    // Using the block again brings its pages back.
+    void *x = sf_malloc(20000);
+    cr_assert_not_null(x, "x is NULL!");
+    cr_assert_eq(arena_heap_size(), heap, "Reused pages not counted again!");
+
+    // With a threshold the tail is released as soon as it is freed.
+    cr_assert(sf_mallopt(SF_OPT_TRIM_THRESHOLD, 8192), "Could not set the trim threshold!");
+    sf_free(x);
+    cr_assert_eq(heap - arena_heap_size(), released, "Free tail was not trimmed!");
+    cr_assert(sf_utilization() <= 1.0, "Utilization above 1!");
+    cr_assert(!sf_trim(0), "Tail was trimmed twice!");
+}
+
+Test(sfmm_student_suite, student_test_20_slab, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    cr_assert(sf_mallopt(SF_OPT_SLAB, 1), "Could not enable slabs!");
+
+    // Objects of a class sit back to back with no header or footer between them.
+    char *x = sf_malloc(8);
+    char *y = sf_malloc(16);
+    cr_assert_eq(y - x, 16, "Slab objects not packed (exp=16, found=%ld)", (long)(y - x));
+    cr_assert(((uintptr_t)x & 15) == 0, "x is not 16-byte aligned!");
+
+    // Only the bytes asked for count as payload, not the rounded object size.
+    cr_assert(sf_fragmentation() == 24.0 / 32, "Slab payload not the requested size!");
+
+    // A different class gets a run of its own.
+    char *z = sf_malloc(100);
+    cr_assert((z - (char *)sf_mem_start()) / PAGE_SZ != (x - (char *)sf_mem_start()) / PAGE_SZ,
+              "Classes share a run!");
+    cr_assert(sf_mem_start() + 2 * PAGE_SZ == sf_mem_end(), "Expected one page per run!");
+
+    // A freed object is handed out again, and never goes near the quick lists.
+    sf_free(x);
+    assert_quick_list_block_count(0, 0);
+    cr_assert_eq(sf_malloc(1), x, "Freed slab object not reused!");
+
+    // Growing past the class moves the object into the ordinary heap.
+    memset(y, 'y', 16);
+    char *w = sf_realloc(y, 500);
+    cr_assert_not_null(w, "Realloc returned NULL!");
+    cr_assert(w[0] == 'y' && w[15] == 'y', "Realloc lost the contents!");
+    cr_assert(sf_mem_start() + 3 * PAGE_SZ == sf_mem_end(), "Expected a page for the ordinary heap!");
+    cr_assert(sf_fragmentation() > 0.0, "Heap walk failed over slab pages!");
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_21_prev_allocated, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    char *x = sf_malloc(500);
+    char *y = sf_malloc(500);
+    char *z = sf_malloc(500);
+    sf_block *by = (sf_block *)(y - sizeof(sf_header));
+    sf_block *bz = (sf_block *)(z - sizeof(sf_header));
+
+    // The first block follows the prologue, and each allocation marks the block after it.
+    cr_assert((((sf_block *)(x - sizeof(sf_header)))->header ^ MAGIC) & PREV_BLOCK_ALLOCATED,
+              "Block after the prologue not marked!");
+    cr_assert((by->header ^ MAGIC) & PREV_BLOCK_ALLOCATED, "y does not see x allocated!");
+
+    // Freeing x clears the bit in y, reusing it sets the bit again.
+    sf_free(x);
+    cr_assert(((by->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) == 0, "y still sees x allocated!");
+    cr_assert_eq(sf_malloc(500), x, "x was not reused!");
+    cr_assert((by->header ^ MAGIC) & PREV_BLOCK_ALLOCATED, "y does not see x allocated again!");
+
+    // Coalescing x and y is found through the bit, and z follows the merged block.
+    sf_free(y);
+    sf_free(x);
+    assert_free_block_count(2 * block_size_for(500), 1);
+    cr_assert(((bz->header ^ MAGIC) & PREV_BLOCK_ALLOCATED) == 0, "z still sees y allocated!");
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_22_defer_coalesce, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    size_t size = block_size_for(1000);
+    cr_assert(sf_mallopt(SF_OPT_DEFER_COALESCE, size + size / 2), "Could not defer coalescing!");
+
+    char *x = sf_malloc(1000);
+    char *y = sf_malloc(1000);
+    sf_malloc(1000);
+
+    // A deferred block is neither coalesced nor on a free list, and is reused as it is.
+    sf_free(x);
+    assert_free_block_count(size, 0);
+    assert_free_block_count(0, 1);
+    cr_assert_eq(sf_malloc(1000), x, "Deferred block was not reused!");
+
+    // Crossing the threshold merges the neighbours in one go.
+    sf_free(x);
+    sf_free(y);
+    assert_free_block_count(2 * size, 1);
+    assert_free_block_count(0, 2);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_23_batch, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    size_t size = block_size_for(100);
+    void *ptrs[8];
+
+    // The blocks are cut back to back from a single free block.
+    cr_assert_eq(sf_malloc_batch(100, 8, ptrs), 8, "Batch was not fully allocated!");
+    for (int i = 1; i < 8; i++) {
+        cr_assert_eq((char *)ptrs[i] - (char *)ptrs[i - 1], size, "Blocks %d and %d are not adjacent!", i - 1, i);
+    }
+    assert_free_block_count(0, 1);
+
+    // Freed in any order, they merge back into the heap's free block without touching the quick lists.
+    void *shuffled[8] = {ptrs[5], ptrs[2], ptrs[7], ptrs[0], ptrs[3], ptrs[6], ptrs[1], ptrs[4]};
+    sf_free_batch(shuffled, 8);
+    assert_quick_list_block_count(0, 0);
+    assert_free_block_count(0, 1);
+    assert_free_block_count(PAGE_FREE_SIZE, 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_24_calloc, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    unsigned char *x = sf_calloc(250, 4);
+    cr_assert_not_null(x, "x is NULL!");
+
+    // The rest of the fresh page has never been handed out.
+    sf_block *rest = (sf_block *)(x - sizeof(sf_header) + block_size_for(1000));
+    cr_assert((rest->header ^ MAGIC) & KNOWN_ZERO, "Fresh free block is not known to be zero!");
+
+    // Once dirty memory is freed into it, it has to be cleared again.
+    memset(x, 0xff, 1000);
+    sf_free(x);
+    sf_block *merged = (sf_block *)(x - sizeof(sf_header));
+    cr_assert(((merged->header ^ MAGIC) & KNOWN_ZERO) == 0, "Dirty free block is known to be zero!");
+
+    unsigned char *y = sf_calloc(1000, 1);
+    cr_assert_eq(y, x, "Freed block was not reused!");
+    for (int i = 0; i < 1000; i++) {
+        cr_assert_eq(y[i], 0, "Byte %d is not zero!", i);
+    }
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+
+    cr_assert_null(sf_calloc(SIZE_MAX / 2, 4), "Overflowing calloc did not return NULL!");
+    cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_student_suite, student_test_25_aligned_alloc, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    void *x = sf_aligned_alloc(64, 240);
+    void *y = sf_aligned_alloc(PAGE_SZ, 1000);
+    void *z = NULL;
+    cr_assert_eq(sf_posix_memalign(&z, 256, 300), 0, "sf_posix_memalign failed!");
+    cr_assert_eq((uintptr_t)x % 64, 0, "x is not 64-byte aligned!");
+    cr_assert_eq((uintptr_t)y % PAGE_SZ, 0, "y is not page aligned!");
+    cr_assert_eq((uintptr_t)z % 256, 0, "z is not 256-byte aligned!");
+
+    // Aligned blocks are ordinary blocks: they can be resized and freed as usual.
+    y = sf_realloc(y, 2000);
+    cr_assert_not_null(y, "y is NULL!");
+    sf_free(x);
+    sf_free(y);
+    sf_free(z);
+    assert_quick_list_block_count(0, 0);
+    assert_free_block_count(0, 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+
+    cr_assert_null(sf_aligned_alloc(48, 100), "Bad alignment did not return NULL!");
+    cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+    cr_assert_eq(sf_posix_memalign(&z, 4, 100), EINVAL, "Bad alignment was accepted!");
+
+    cr_assert_null(sf_aligned_alloc(64, MAX_HEAP_REQUEST), "Oversized request did not return NULL!");
+    cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
+}
+
+Test(sfmm_student_suite, student_test_26_free_sized, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    char *x = sf_malloc(1000);
+    cr_assert_eq(sf_malloc_usable_size(x), block_size_for(1000) - sizeof(sf_header) - ALLOCATED_FOOTER_SIZE,
+                 "Wrong usable size!");
+
+    // The padding belongs to the caller and survives a move.
+    size_t usable = sf_malloc_usable_size(x);
+    memset(x, 'x', usable);
+    void *y = sf_malloc(240);
+    x = sf_realloc(x, 3000);
+    for (size_t i = 0; i < usable; i++) {
+        cr_assert_eq(x[i], 'x', "Byte %zu was not kept!", i);
+    }
+
+    sf_free_sized(y, 240);
+    sf_free_sized(x, sf_malloc_usable_size(x));
+    assert_quick_list_block_count(0, 0);
+    assert_free_block_count(0, 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+#ifndef TRUST_SIZED_FREE
+Test(sfmm_student_suite, student_test_27_free_sized_wrong_size, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+    void *x = sf_malloc(100);
+    sf_free_sized(x, 200);
+}
+#endif
+
+Test(sfmm_student_suite, student_test_28_latency_paths, .timeout = TEST_TIMEOUT) {
+    sf_latency_reset();
+    void *x = sf_malloc(100);
+    void *y = sf_malloc(300);
+    sf_free(x);
+    void *z = sf_malloc(100);
+    y = sf_realloc(y, 200);
+    sf_free(y);
+    sf_free(z);
+
+    // Only a profiling build fills the histograms in.
+#ifdef PROFILE_LATENCY
+    uint64_t once = 1;
+#else
+    uint64_t once = 0;
+#endif
+    cr_assert_eq(sf_latency_count(SF_PATH_MALLOC_GROW), once, "Wrong count of heap growths!");
+    cr_assert_eq(sf_latency_count(SF_PATH_MALLOC_SPLIT), once, "Wrong count of splits!");
+    cr_assert_eq(sf_latency_count(SF_PATH_MALLOC_QUICK), once, "Wrong count of quick list hits!");
+    cr_assert_eq(sf_latency_count(SF_PATH_FREE_QUICK), 2 * once, "Wrong count of quick list frees!");
+    cr_assert_eq(sf_latency_count(SF_PATH_REALLOC_SHRINK), once, "Wrong count of shrinks!");
+    cr_assert_eq(sf_latency_count(SF_PATH_FREE_NEXT), once, "Wrong count of coalesces!");
+    cr_assert_leq(sf_latency_percentile(SF_PATH_MALLOC_SPLIT, 0.5),
+                  sf_latency_percentile(SF_PATH_MALLOC_SPLIT, 0.999), "Percentiles out of order!");
+}
+
+Test(sfmm_student_suite, student_test_29_stats, .timeout = TEST_TIMEOUT) {
+    void *x = sf_malloc(100);
+    void *y = sf_malloc(300);
+    sf_free(x);
+    void *z = sf_malloc(100);
+
+    sf_stats stats;
+    sf_get_stats(&stats);
+    int index = QUICK_LIST_INDEX(block_size_for(100));
+    cr_assert_eq(stats.quick_hits[index], 1, "Wrong number of quick list hits!");
+    cr_assert_eq(stats.quick_misses[index], 1, "Wrong number of quick list misses!");
+    cr_assert_eq(stats.splits, 2, "Wrong number of splits!");
+    cr_assert_geq(stats.mem_grows, 1, "The heap was never grown!");
+
+    uint64_t hits = 0, blocks = 0, bytes = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        hits += stats.free_list_hits[i];
+        blocks += stats.live_blocks[i];
+        bytes += stats.live_bytes[i];
+    }
+    cr_assert_eq(hits, 1, "Wrong number of free list hits!");
+    cr_assert_eq(blocks, 2, "Wrong number of live blocks!");
+    cr_assert_eq(bytes, block_size_for(100) + block_size_for(300), "Wrong number of live bytes!");
+
+    sf_free(y);
+    sf_free(z);
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.coalesce_next, 1, "Wrong number of coalesces!");
+    cr_assert_eq(stats.live_blocks[get_free_list_index(block_size_for(300))], 0, "Blocks still live!");
+}
+
+Test(sfmm_student_suite, student_test_30_fragmentation_totals, .timeout = TEST_TIMEOUT) {
+    void *ptrs[8];
+    size_t sizes[8] = {10, 100, 300, 40, 1000, 60, 2000, 150};
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = sf_malloc(sizes[i]);
+    }
+    cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-9, "Totals disagree after mallocs!");
+
+    // Quick list blocks, splits, in-place growth and batches all move the totals.
+    sf_free(ptrs[1]);
+    sf_free(ptrs[5]);
+    ptrs[2] = sf_realloc(ptrs[2], 100);
+    ptrs[6] = sf_realloc(ptrs[6], 3000);
+    sf_free_batch(ptrs + 3, 2);
+    cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-9, "Totals disagree after frees!");
+
+    void *batch[4];
+    cr_assert_eq(sf_malloc_batch(50, 4, batch), 4, "Batch allocation failed!");
+    cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-9, "Totals disagree after a batch!");
+}
+
+Test(sfmm_student_suite, student_test_31_external_fragmentation, .timeout = TEST_TIMEOUT) {
+    void *ptrs[5];
+    for (int i = 0; i < 5; i++) {
+        ptrs[i] = sf_malloc(1000);
+    }
+    sf_free(ptrs[1]);
+    sf_free(ptrs[3]);
+
+    sf_stats stats;
+    sf_get_stats(&stats);
+    size_t size = block_size_for(1000);
+    int index = get_free_list_index(size);
+    cr_assert_geq(stats.free_blocks[index], 2, "Freed blocks missing from the histogram!");
+    cr_assert_geq(stats.free_bytes[index], 2 * size, "Freed bytes missing from the histogram!");
+
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        total += stats.free_bytes[i];
+    }
+    cr_assert_gt(stats.largest_free, size, "The free tail should be the largest block!");
+    cr_assert_float_eq(sf_external_fragmentation(), 1 - (double)stats.largest_free / total, 1e-9,
+                       "Wrong external fragmentation!");
+
+    // Freeing the rest merges everything back into one block.
+    sf_free(ptrs[0]);
+    sf_free(ptrs[2]);
+    sf_free(ptrs[4]);
+    cr_assert_float_eq(sf_external_fragmentation(), 0, 1e-9, "Free space should be in one block!");
+}
+
+Test(sfmm_student_suite, student_test_32_adaptive_quick_list, .timeout = TEST_TIMEOUT) {
+    cr_assert_eq(sf_mallopt(SF_OPT_QUICK_LIST_MAX, 32), 1, "sf_mallopt failed!");
+
+    // Six objects of one size round a loop, one more than a quick list starts out holding.
+    void *ptrs[QUICK_LIST_MAX + 1];
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+            ptrs[i] = sf_malloc(32);
+        }
+        for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+            sf_free(ptrs[i]);
+        }
+        if (round == 0) {
+            // Only the oldest half was flushed to make room for the sixth.
+            assert_quick_list_block_count(48, QUICK_LIST_MAX / 2 + 1);
+        }
+    }
+
+    // The flushed blocks were asked for again, so the list grew and holds all six.
+    assert_quick_list_block_count(48, QUICK_LIST_MAX + 1);
+    sf_stats stats;
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.quick_flushes[QUICK_LIST_INDEX(48)], 1, "The quick list kept flushing!");
+}
+
+Test(sfmm_student_suite, student_test_33_sorted_flush, .timeout = TEST_TIMEOUT) {
+    void *ptrs[QUICK_LIST_MAX + 1];
+    for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+        ptrs[i] = sf_malloc(32);
+    }
+
+    // Neighbours freed out of address order still merge before reaching the free lists.
+    int order[QUICK_LIST_MAX] = {3, 1, 4, 0, 2};
+    for (int i = 0; i < QUICK_LIST_MAX; i++) {
+        sf_free(ptrs[order[i]]);
+    }
+    sf_free(ptrs[QUICK_LIST_MAX]);
+
+    assert_free_block_count(240, 1);
+    sf_stats stats;
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.coalesce_none + stats.coalesce_prev + stats.coalesce_next + stats.coalesce_both, 1,
+                 "The flushed blocks were coalesced one at a time!");
+}
+
+Test(sfmm_student_suite, student_test_34_fragmentation_with_tcache, .timeout = TEST_TIMEOUT) {
+    // A second thread allocating alongside this one switches the per-thread caches on.
+    void *big = sf_malloc(1000);
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_cache_worker, (void *)1);
+    pthread_join(thread, NULL);
+
+    void *ptrs[9];
+    for (int i = 0; i < 8; i++) {
+        ptrs[i] = sf_malloc(40);
+    }
+    ptrs[8] = sf_malloc(100);  // A refill, which settles the mallocs before it
+    for (int i = 0; i < 9; i++) {
+        sf_free(ptrs[i]);
+    }
+
+    // The frees are still pending in this thread's cache, but must already count.
+    cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-9, "Totals disagree with a cache on!");
+    sf_free(big);
+    cr_assert_float_eq(sf_fragmentation(), 0, 1e-9, "Nothing is allocated!");
+}
+
+/* The largest block on the free lists of arena 0. */
+static size_t largest_listed_free_block(void) {
+    size_t largest = 0;
+    for (int i = 0; i < NUM_FREE_LISTS; i++)
+        for (sf_block *bp = next_free_block(&sf_free_list_heads[i]); bp != &sf_free_list_heads[i];
+             bp = next_free_block(bp))
+            if (((bp->header ^ sf_magic()) & ~0xffffffff0000000f) > largest)
+                largest = (bp->header ^ sf_magic()) & ~0xffffffff0000000f;
+    return largest;
+}
+
+Test(sfmm_student_suite, student_test_35_largest_free_equal_sizes, .timeout = TEST_TIMEOUT) {
+    // Many free blocks of one size, kept apart by small allocated ones.
+    void *ptrs[64];
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = sf_malloc(i % 2 ? 10 : 1000);
+    }
+    size_t tail = largest_listed_free_block();
+    sf_malloc(tail - sizeof(sf_header) - ALLOCATED_FOOTER_SIZE);
+    cr_assert_eq(largest_listed_free_block(), 0, "The heap's free tail is still there!");
+    for (int i = 0; i < 64; i += 2) {
+        sf_free(ptrs[i]);
+    }
+
+    // Taking them back one by one keeps losing a block of the largest size.
+    sf_stats stats;
+    sf_get_stats(&stats);
+    cr_assert_geq(stats.largest_free, block_size_for(1000), "Wrong largest free block!");
+    for (int i = 0; i < 64; i += 2) {
+        sf_get_stats(&stats);
+        cr_assert_eq(stats.largest_free, largest_listed_free_block(), "Wrong largest free block!");
+        ptrs[i] = sf_malloc(1000);
+    }
+    sf_get_stats(&stats);
+    cr_assert_eq(stats.largest_free, largest_listed_free_block(), "Wrong largest free block!");
+}
+
+Test(sfmm_student_suite, student_test_36_slab_thread_cache, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    pthread_t threads[4];
+    cr_assert(sf_mallopt(SF_OPT_SLAB, 1), "Could not enable slabs!");
+
+    char *x = sf_malloc(8);
+    char *y = sf_malloc(8);
+    cr_assert_eq(y - x, 16, "Slab objects not packed!");
+
+    for (long i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, thread_cache_worker, (void *)(i + 1));
+    for (int i = 0; i < 4; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        cr_assert_null(result, "Thread %d saw a bad allocation!", i);
+    }
+
+    // Exiting threads gave their bins back, so only x and y are left in the runs.
+    cr_assert(sf_fragmentation_walk() == 16.0 / 32, "Slab objects left behind!");
+
+    // With threads about, a freed object goes to the thread's bin, still taken from its run.
+    sf_free(x);
+    cr_assert(sf_fragmentation_walk() == 8.0 / 32, "Freed object not in the thread's bin!");
+    cr_assert(sf_fragmentation() == sf_fragmentation_walk(), "Running totals disagree with the walk!");
+    cr_assert_eq(sf_malloc(8), x, "Cached slab object not reused!");
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+Test(sfmm_student_suite, student_test_37_show_heap, .timeout = TEST_TIMEOUT) {
+    sf_errno = 0;
+    char *x = sf_malloc(24);
+    sf_malloc(8);
+    void *y = sf_malloc(240);
+    sf_malloc(8);
+
+    // Shrinking x leaves a minimal free block behind with 16-byte blocks, a splinter otherwise.
+    x = sf_realloc(x, 8);
+    sf_free(y);
+
+    // The printers follow the free lists through their links, compact ones included.
+    sf_show_heap();
+    sf_show_free_lists();
+    assert_free_block_count(0, MIN_BLOCK_SIZE == 16 ? 3 : 2);
+    assert_free_block_count(block_size_for(240), 1);
+    cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}